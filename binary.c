@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "dive.h"
+#include "membuffer.h"
+
+/*
+ * The native binary log format.
+ *
+ * Parsing the XML on every start gets slow once you have a few
+ * decades of dives, so this is a format that we can just mmap():
+ *
+ *	header
+ *	dive directory: one fixed-size entry per dive, sorted by time
+ *	string table: NUL-terminated names, locations and notes
+ *	samples: a block of fixed-size samples per dive
+ *
+ * Everything is little-endian, and all the on-disk structures are
+ * built out of byte arrays, so there's no padding or alignment to
+ * worry about.
+ *
+ * Opening a log only reads the header, the directory and the string
+ * table. The samples stay in the mapping until somebody actually
+ * looks at them: the dive gets allocated with room for them, but
+ * 'samples' stays zero and 'packed' points to the sample block until
+ * unpack_samples() decodes it. So the mapping has to stay around
+ * for as long as any of its dives do, and we never unmap it.
+ *
+ * The directory entry size is in the header, so later versions can
+ * add fields at the end of an entry, and older readers just skip
+ * them. The cylinder sizes were added like that.
+ */
+#define BINARY_MAGIC "DIVECLOG"
+#define BINARY_VERSION 1
+
+#define FLUSH_SIZE (256*1024)
+
+typedef struct { unsigned char b[4]; } le32;
+typedef struct { unsigned char b[8]; } le64;
+
+struct disk_header {
+	char magic[8];
+	le32 version;
+	le32 header_size;
+	le32 nr_dives;
+	le32 entry_size;
+	le64 dir_offset;
+	le64 strings_offset, strings_size;
+	le64 samples_offset, samples_size;
+};
+
+/* String offsets are into the string table. Zero means no string. */
+struct disk_dive {
+	le64 when;
+	le32 name, location, notes;
+	le32 maxdepth, meandepth;
+	le32 duration, surfacetime;
+	le32 visibility;
+	le32 airtemp, watertemp;
+	le32 beginning_pressure, end_pressure;
+	le32 gasmix[MAX_MIXES][2];
+	le32 samples;
+	le64 sample_offset;
+
+	/* Added later: logs from before don't have these */
+	le32 tank_type[MAX_MIXES][2];
+};
+
+/* The entries of the logs from before the cylinder sizes */
+#define OLD_ENTRY_SIZE offsetof(struct disk_dive, tank_type)
+
+struct disk_sample {
+	le32 time, depth, temperature, pressure, tankindex;
+};
+
+static unsigned int get32(le32 x)
+{
+	const unsigned char *b = x.b;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int) b[3] << 24);
+}
+
+static unsigned long long get64(le64 x)
+{
+	le32 lo, hi;
+
+	memcpy(lo.b, x.b, 4);
+	memcpy(hi.b, x.b + 4, 4);
+	return get32(lo) | ((unsigned long long) get32(hi) << 32);
+}
+
+static void put32(le32 *x, unsigned int val)
+{
+	x->b[0] = val;
+	x->b[1] = val >> 8;
+	x->b[2] = val >> 16;
+	x->b[3] = val >> 24;
+}
+
+static void put64(le64 *x, unsigned long long val)
+{
+	le32 lo, hi;
+
+	put32(&lo, val);
+	put32(&hi, val >> 32);
+	memcpy(x->b, lo.b, 4);
+	memcpy(x->b + 4, hi.b, 4);
+}
+
+/*
+ * Samples get looked at from the thumbnail thread and from the GUI,
+ * and not all of that has the dive table locked, so unpacking has a
+ * lock of its own. Whoever gets there first does the work, and
+ * 'packed' only goes away once the samples are all there, which is
+ * what load_samples() checks without any lock.
+ */
+static pthread_mutex_t unpack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void unpack_samples(struct dive *dive)
+{
+	const struct disk_sample *s;
+	int i, nr;
+
+	pthread_mutex_lock(&unpack_lock);
+	s = dive->packed;
+	if (!s)
+		goto out;
+	nr = dive->packed_samples;
+	for (i = 0; i < nr; i++, s++) {
+		struct sample *sample = dive->sample + i;
+
+		sample->time.seconds = get32(s->time);
+		sample->depth.mm = get32(s->depth);
+		sample->temperature.mkelvin = get32(s->temperature);
+		sample->tankpressure.mbar = get32(s->pressure);
+		sample->tankindex = get32(s->tankindex);
+	}
+	dive->samples = nr;
+	__atomic_store_n(&dive->packed, NULL, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&unpack_lock);
+}
+
+static void pack_sample(struct disk_sample *s, const struct sample *sample)
+{
+	put32(&s->time, sample->time.seconds);
+	put32(&s->depth, sample->depth.mm);
+	put32(&s->temperature, sample->temperature.mkelvin);
+	put32(&s->pressure, sample->tankpressure.mbar);
+	put32(&s->tankindex, sample->tankindex);
+}
+
+static unsigned int add_string(struct membuffer *strings, const char *s)
+{
+	unsigned int offset = strings->len;
+
+	if (!s)
+		return 0;
+	put_bytes(strings, s, strlen(s) + 1);
+	return offset;
+}
+
+static void pack_dive(struct disk_dive *d, struct dive *dive, struct membuffer *strings, unsigned long long sample_offset)
+{
+	int i, samples;
+
+	memset(d, 0, sizeof(*d));
+	put64(&d->when, dive->when);
+	put32(&d->name, add_string(strings, dive->name));
+	put32(&d->location, add_string(strings, dive->location));
+	put32(&d->notes, add_string(strings, dive->notes));
+	put32(&d->maxdepth, dive->maxdepth.mm);
+	put32(&d->meandepth, dive->meandepth.mm);
+	put32(&d->duration, dive->duration.seconds);
+	put32(&d->surfacetime, dive->surfacetime.seconds);
+	put32(&d->visibility, dive->visibility.mm);
+	put32(&d->airtemp, dive->airtemp.mkelvin);
+	put32(&d->watertemp, dive->watertemp.mkelvin);
+	put32(&d->beginning_pressure, dive->beginning_pressure.mbar);
+	put32(&d->end_pressure, dive->end_pressure.mbar);
+	for (i = 0; i < MAX_MIXES; i++) {
+		put32(&d->gasmix[i][0], dive->gasmix[i].o2.permille);
+		put32(&d->gasmix[i][1], dive->gasmix[i].he.permille);
+		put32(&d->tank_type[i][0], dive->tank_type[i].size.mliter);
+		put32(&d->tank_type[i][1], dive->tank_type[i].pressure.mbar);
+	}
+	samples = dive->packed ? dive->packed_samples : dive->samples;
+	put32(&d->samples, samples);
+	put64(&d->sample_offset, sample_offset);
+}
+
+/* Samples that are still packed can just be copied over */
+static void put_samples(struct membuffer *b, struct dive *dive)
+{
+	int i;
+
+	if (dive->packed) {
+		put_bytes(b, dive->packed, dive->packed_samples * sizeof(struct disk_sample));
+		return;
+	}
+	for (i = 0; i < dive->samples; i++) {
+		struct disk_sample s;
+
+		pack_sample(&s, dive->sample + i);
+		put_bytes(b, (const char *) &s, sizeof(s));
+	}
+}
+
+static int dive_samples(struct dive *dive)
+{
+	return dive->packed ? dive->packed_samples : dive->samples;
+}
+
+/* Everything that goes before the samples: header, directory and strings */
+static void put_binary_head(struct membuffer *b)
+{
+	struct membuffer strings = { 0 };
+	struct disk_header hdr;
+	unsigned long long offset;
+	int i, nr;
+
+	if (!dive_table.sorted)
+		sort_dive_table();
+	nr = dive_table.nr;
+
+	/* The string table starts with a NUL, so that offset 0 is "none" */
+	put_char(&strings, 0);
+
+	make_room(b, sizeof(hdr) + nr * sizeof(struct disk_dive));
+	b->len = sizeof(hdr) + nr * sizeof(struct disk_dive);
+	offset = 0;
+	for (i = 0; i < nr; i++) {
+		struct dive *dive = dive_table.dives[i];
+		struct disk_dive *d = (struct disk_dive *) (b->buffer + sizeof(hdr)) + i;
+
+		pack_dive(d, dive, &strings, offset);
+		offset += dive_samples(dive) * sizeof(struct disk_sample);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BINARY_MAGIC, 8);
+	put32(&hdr.version, BINARY_VERSION);
+	put32(&hdr.header_size, sizeof(hdr));
+	put32(&hdr.nr_dives, nr);
+	put32(&hdr.entry_size, sizeof(struct disk_dive));
+	put64(&hdr.dir_offset, sizeof(hdr));
+	put64(&hdr.strings_offset, b->len);
+	put64(&hdr.strings_size, strings.len);
+	put64(&hdr.samples_offset, b->len + strings.len);
+	put64(&hdr.samples_size, offset);
+	memcpy(b->buffer, &hdr, sizeof(hdr));
+	put_bytes(b, strings.buffer, strings.len);
+	free_buffer(&strings);
+}
+
+/*
+ * The whole binary log in memory, for the journal compaction. With
+ * the dive table locked, of course.
+ */
+void format_binary(struct membuffer *b)
+{
+	int i;
+
+	put_binary_head(b);
+	for (i = 0; i < dive_table.nr; i++)
+		put_samples(b, dive_table.dives[i]);
+}
+
+/*
+ * Write the dive table as a binary log. Like write_dives(), this
+ * expects the dive table to be locked.
+ *
+ * We write to a temporary file and rename it into place, since the
+ * file we're replacing may well be the one that our unpacked
+ * samples are mapped from.
+ */
+int save_binary_file(const char *filename)
+{
+	struct membuffer b = { 0 }, tmp = { 0 };
+	int i, fd, err;
+
+	put_binary_head(&b);
+	put_format(&tmp, "%s.tmp", filename);
+	put_char(&tmp, 0);
+	fd = open(tmp.buffer, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		goto fail;
+
+	for (i = 0; i < dive_table.nr; i++) {
+		put_samples(&b, dive_table.dives[i]);
+		if (b.len >= FLUSH_SIZE && write_buffer(&b, fd) < 0)
+			goto close_fail;
+	}
+	if (write_buffer(&b, fd) < 0 || fsync(fd) < 0)
+		goto close_fail;
+	if (close(fd) < 0 || rename(tmp.buffer, filename) < 0)
+		goto unlink_fail;
+	free_buffer(&b);
+	free_buffer(&tmp);
+	return 0;
+
+close_fail:
+	err = errno;
+	close(fd);
+	errno = err;
+unlink_fail:
+	err = errno;
+	unlink(tmp.buffer);
+	errno = err;
+fail:
+	err = errno;
+	fprintf(stderr, "Failed to save '%s': %s\n", filename, strerror(err));
+	free_buffer(&b);
+	free_buffer(&tmp);
+	errno = err;
+	return -1;
+}
+
+static char *get_string(const char *strings, unsigned long long size, le32 x)
+{
+	unsigned int offset = get32(x);
+	char *s;
+
+	if (!offset || offset >= size)
+		return NULL;
+	s = strdup(strings + offset);
+	if (!s)
+		exit(1);
+	return s;
+}
+
+static void unpack_dive(const struct disk_dive *d, unsigned int entry_size,
+	const char *strings, unsigned long long strings_size, const unsigned char *samples)
+{
+	int i, nr = get32(d->samples);
+	struct dive *dive;
+
+	dive = malloc(dive_size(nr));
+	if (!dive)
+		exit(1);
+
+	/* Don't touch the sample space: that's what unpacking is for */
+	memset(dive, 0, sizeof(*dive));
+	dive->when = (long long) get64(d->when);
+	dive->name = get_string(strings, strings_size, d->name);
+	dive->location = get_string(strings, strings_size, d->location);
+	dive->notes = get_string(strings, strings_size, d->notes);
+	dive->maxdepth.mm = get32(d->maxdepth);
+	dive->meandepth.mm = get32(d->meandepth);
+	dive->duration.seconds = get32(d->duration);
+	dive->surfacetime.seconds = get32(d->surfacetime);
+	dive->visibility.mm = get32(d->visibility);
+	dive->airtemp.mkelvin = get32(d->airtemp);
+	dive->watertemp.mkelvin = get32(d->watertemp);
+	dive->beginning_pressure.mbar = get32(d->beginning_pressure);
+	dive->end_pressure.mbar = get32(d->end_pressure);
+	for (i = 0; i < MAX_MIXES; i++) {
+		dive->gasmix[i].o2.permille = get32(d->gasmix[i][0]);
+		dive->gasmix[i].he.permille = get32(d->gasmix[i][1]);
+	}
+	if (entry_size >= sizeof(struct disk_dive)) {
+		for (i = 0; i < MAX_MIXES; i++) {
+			dive->tank_type[i].size.mliter = get32(d->tank_type[i][0]);
+			dive->tank_type[i].pressure.mbar = get32(d->tank_type[i][1]);
+		}
+	}
+	dive->packed = samples + get64(d->sample_offset);
+	dive->packed_samples = nr;
+
+	/* No samples yet, so this won't change anything */
+	record_dive(dive);
+}
+
+/* Nothing of a bad file got used, so the mapping can go */
+static int bad_file(const char *filename, const char *why, const unsigned char *map, size_t size)
+{
+	fprintf(stderr, "Bad binary log '%s': %s\n", filename, why);
+	munmap((void *) map, size);
+	return 0;
+}
+
+/*
+ * Returns -1 if 'filename' isn't a binary log at all, so that the
+ * caller can go on and parse it as XML.
+ */
+int parse_binary_file(const char *filename)
+{
+	char magic[8];
+	const unsigned char *map;
+	const struct disk_header *hdr;
+	unsigned long long dir, strings, strings_size, samples, samples_size;
+	unsigned int i, nr, entry_size;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct disk_header) ||
+	    pread(fd, magic, 8, 0) != 8 || memcmp(magic, BINARY_MAGIC, 8)) {
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map '%s': %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	/* We'll jump around in here, don't bother reading ahead */
+	madvise((void *) map, size, MADV_RANDOM);
+
+	hdr = (const struct disk_header *) map;
+	if (get32(hdr->version) > BINARY_VERSION)
+		return bad_file(filename, "made by a newer version", map, size);
+
+	nr = get32(hdr->nr_dives);
+	entry_size = get32(hdr->entry_size);
+	dir = get64(hdr->dir_offset);
+	strings = get64(hdr->strings_offset);
+	strings_size = get64(hdr->strings_size);
+	samples = get64(hdr->samples_offset);
+	samples_size = get64(hdr->samples_size);
+
+	if (entry_size < OLD_ENTRY_SIZE ||
+	    dir > size || (size - dir) / entry_size < nr ||
+	    strings > size || size - strings < strings_size ||
+	    samples > size || size - samples < samples_size)
+		return bad_file(filename, "truncated", map, size);
+	if (!strings_size || map[strings + strings_size - 1])
+		return bad_file(filename, "bad string table", map, size);
+
+	/* Check all of them before we add any dive to the table */
+	for (i = 0; i < nr; i++) {
+		const struct disk_dive *d = (const void *) (map + dir + (unsigned long long) i * entry_size);
+		unsigned long long offset = get64(d->sample_offset);
+		unsigned long long len = get32(d->samples) * (unsigned long long) sizeof(struct disk_sample);
+
+		if (offset > samples_size || samples_size - offset < len)
+			return bad_file(filename, "bad sample block", map, size);
+	}
+	for (i = 0; i < nr; i++) {
+		const struct disk_dive *d = (const void *) (map + dir + (unsigned long long) i * entry_size);
+
+		unpack_dive(d, entry_size, (const char *) map + strings, strings_size, map + samples);
+	}
+	return 0;
+}
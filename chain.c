@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "deco.h"
+
+/*
+ * Repetitive dives: every dive starts with what the dives before it
+ * left behind, so working that out for one dive means going through
+ * every dive before it. Instead, we keep a checkpoint at the start of
+ * every dive in the (time-sorted) table, with the surface interval
+ * filled in as we go.
+ *
+ * Changing the table only marks the time range of the change. The
+ * checkpoints before it are still good, and so are the ones after it
+ * once we get to a dive that starts with the same state it had before
+ * (they've just moved by the number of dives that came or went). After
+ * a surface interval long enough that nothing carries over, that's
+ * every dive whose old start state was clean too.
+ * So an import into the middle of a long history only redoes the
+ * dives up to the next real break, not the whole log.
+ */
+struct chain_entry {
+	struct dive *dive;
+	time_t when;
+	struct chain_state start;
+	double cns, otu;	/* at the end of the dive */
+};
+
+static struct chain {
+	pthread_mutex_t lock;
+	int nr, allocated;
+	struct chain_entry *entry;
+
+	/* What changed since the last update */
+	int dirty;
+	time_t dirty_start, dirty_end;
+} chain = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* The dives from 'start' to 'end' changed, or came or went */
+void chain_changed(time_t start, time_t end)
+{
+	pthread_mutex_lock(&chain.lock);
+	if (!chain.dirty) {
+		chain.dirty_start = start;
+		chain.dirty_end = end;
+		chain.dirty = 1;
+	}
+	if (start < chain.dirty_start)
+		chain.dirty_start = start;
+	if (end > chain.dirty_end)
+		chain.dirty_end = end;
+	pthread_mutex_unlock(&chain.lock);
+}
+
+/* The first old entry after 'when' */
+static int entry_after(time_t when)
+{
+	int lo = 0, hi = chain.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (chain.entry[mid].when <= when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void grow_chain(int nr)
+{
+	if (nr > chain.allocated) {
+		int allocated = (nr + 32) * 3 / 2;
+		struct chain_entry *entry = realloc(chain.entry, allocated * sizeof(*entry));
+		if (!entry)
+			exit(1);
+		chain.entry = entry;
+		chain.allocated = allocated;
+	}
+}
+
+static void set_surfacetime(struct dive *prev, struct dive *dive)
+{
+	long interval = 0;
+
+	if (prev) {
+		interval = dive->when - prev->when - prev->duration.seconds;
+		if (interval < 0)
+			interval = 0;
+	}
+	dive->surfacetime.seconds = interval;
+}
+
+static void update(void)
+{
+	int nr = dive_table.nr;
+	int first, old_tail, tail, i;
+	struct chain_state state;
+
+	/* Still loading the dives? Wait until they're sorted */
+	if (!chain.dirty || !dive_table.sorted)
+		return;
+
+	/* Where the changed dives are, and where the unchanged ones after them went */
+	first = dive_index_after(chain.dirty_start);
+	tail = dive_index_after(chain.dirty_end + 1);
+	old_tail = entry_after(chain.dirty_end);
+
+	grow_chain(nr);
+	memmove(chain.entry + tail, chain.entry + old_tail, (chain.nr - old_tail) * sizeof(*chain.entry));
+	chain.nr = nr;
+	chain.dirty = 0;
+
+	/* Back to the checkpoint of the dive before the change */
+	i = first;
+	if (i) {
+		i--;
+		state = chain.entry[i].start;
+	} else {
+		clear_chain_state(&state);
+		if (nr)
+			set_surfacetime(NULL, dive_table.dives[0]);
+	}
+
+	for (; i < nr; i++) {
+		struct chain_entry *e = chain.entry + i;
+		struct dive *dive = dive_table.dives[i];
+		struct dive *next;
+
+		e->dive = dive;
+		e->when = dive->when;
+		e->start = state;
+		deco_walk(&state, dive, NULL);
+		e->cns = state.cns;
+		e->otu = state.otu;
+
+		next = get_dive(i + 1);
+		if (!next)
+			break;
+		set_surfacetime(dive, next);
+
+		/*
+		 * Past the change, and the next dive starts with what it
+		 * started with before: the rest is still good. That's
+		 * usually because nothing carries over any more, but it
+		 * has to have been the same before the change too.
+		 */
+		deco_surface(&state, next->surfacetime.seconds);
+		if (i + 1 >= tail && !memcmp(&state, &chain.entry[i+1].start, sizeof(state)))
+			break;
+	}
+}
+
+/*
+ * Bring the checkpoints up to date with the dive table. That happens
+ * by itself when they get looked at, but you may want it done before
+ * starting threads that will all look at them.
+ */
+void update_chain(void)
+{
+	pthread_mutex_lock(&chain.lock);
+	update();
+	pthread_mutex_unlock(&chain.lock);
+}
+
+static struct chain_entry *find_entry(struct dive *dive)
+{
+	int idx;
+
+	if (chain.dirty)
+		return NULL;
+	idx = dive_table_index(dive);
+	if (idx < 0 || idx >= chain.nr || chain.entry[idx].dive != dive)
+		return NULL;
+	return chain.entry + idx;
+}
+
+/* What the dives before it left for 'dive' */
+void chain_start(struct dive *dive, struct chain_state *state)
+{
+	struct chain_entry *e;
+
+	pthread_mutex_lock(&chain.lock);
+	update();
+	e = find_entry(dive);
+	if (e)
+		*state = e->start;
+	else
+		clear_chain_state(state);
+	pthread_mutex_unlock(&chain.lock);
+}
+
+/* The CNS (percent) and OTUs at the end of 'dive' */
+int chain_exposure(struct dive *dive, double *cns, double *otu)
+{
+	struct chain_entry *e;
+
+	pthread_mutex_lock(&chain.lock);
+	update();
+	e = find_entry(dive);
+	if (e) {
+		*cns = e->cns;
+		*otu = e->otu;
+	}
+	pthread_mutex_unlock(&chain.lock);
+	return e ? 0 : -1;
+}
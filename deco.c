@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "deco.h"
+
+/*
+ * Buhlmann ZHL-16C: sixteen compartments, each with its own halftime
+ * for nitrogen and for helium, loaded and unloaded as the dive goes
+ * along. Between two samples the ambient pressure changes linearly,
+ * which is the Schreiner equation for every compartment.
+ *
+ * The compartments are independent of each other, so they go four
+ * at a time in vectors (the gcc vector extensions, so this is just
+ * SSE or AVX or whatever the target has). The only exponentials are
+ * the e^-kt for a segment length, and the samples of a dive are
+ * mostly evenly spaced, so those are only worked out again when the
+ * sample interval changes.
+ *
+ * Each dive starts with what the dives before it left in the tissues,
+ * which is what chain.c keeps track of. That doesn't depend on the
+ * gradient factors, so changing them only means redoing the ceilings
+ * of the dive you look at.
+ */
+#define LANES 4
+#define VECS (COMPARTMENTS / LANES)
+
+/* Only as aligned as a double, so they can live in malloc'ed memory */
+typedef double vec __attribute__((vector_size(LANES * sizeof(double)), aligned(sizeof(double))));
+
+/* Halftimes in minutes, and the M-value coefficients a (bar) and b */
+static const vec n2_halftime[VECS] = {
+	{ 5.0, 8.0, 12.5, 18.5 },
+	{ 27.0, 38.3, 54.3, 77.0 },
+	{ 109.0, 146.0, 187.0, 239.0 },
+	{ 305.0, 390.0, 498.0, 635.0 },
+};
+
+static const vec n2_a[VECS] = {
+	{ 1.1696, 1.0, 0.8618, 0.7562 },
+	{ 0.62, 0.5043, 0.441, 0.4 },
+	{ 0.375, 0.35, 0.3295, 0.3065 },
+	{ 0.2835, 0.261, 0.248, 0.2327 },
+};
+
+static const vec n2_b[VECS] = {
+	{ 0.5578, 0.6514, 0.7222, 0.7825 },
+	{ 0.8126, 0.8434, 0.8693, 0.8910 },
+	{ 0.9092, 0.9222, 0.9319, 0.9403 },
+	{ 0.9477, 0.9544, 0.9602, 0.9653 },
+};
+
+static const vec he_halftime[VECS] = {
+	{ 1.88, 3.02, 4.72, 6.99 },
+	{ 10.21, 14.48, 20.53, 29.11 },
+	{ 41.20, 55.19, 70.69, 90.34 },
+	{ 115.29, 147.42, 188.24, 240.03 },
+};
+
+static const vec he_a[VECS] = {
+	{ 1.6189, 1.383, 1.1919, 1.0458 },
+	{ 0.9220, 0.8205, 0.7305, 0.6502 },
+	{ 0.5950, 0.5545, 0.5333, 0.5189 },
+	{ 0.5181, 0.5176, 0.5172, 0.5119 },
+};
+
+static const vec he_b[VECS] = {
+	{ 0.4770, 0.5747, 0.6527, 0.7223 },
+	{ 0.7582, 0.7957, 0.8279, 0.8553 },
+	{ 0.8757, 0.8903, 0.8997, 0.9073 },
+	{ 0.9122, 0.9171, 0.9217, 0.9267 },
+};
+
+/* Bar, and sea water: 10m (10000mm) to the bar */
+#define SURFACE_PRESSURE 1.01325
+#define WATER_VAPOR 0.0627
+#define MM_PER_BAR 10000.0
+
+#define AIR_N2 0.791
+
+/* After four days, there's nothing left of a dive */
+#define MAX_SURFACE_INTERVAL (4 * 24 * 3600)
+
+/* The OTUs count up until a day out of the water */
+#define OTU_INTERVAL (24 * 3600)
+
+/* The CNS oxygen clock halftime at the surface, in seconds */
+#define CNS_HALFTIME (90 * 60)
+
+int gf_low = 30, gf_high = 85;
+
+/* The tissues while we work on them */
+struct vec_tissues {
+	vec n2[VECS], he[VECS];
+};
+
+struct deco_state {
+	struct vec_tissues t;
+
+	/* e^-kt for segments of 'dt' seconds */
+	int dt;
+	vec n2_factor[VECS], he_factor[VECS];
+
+	/* The deepest ceiling at gf_low so far: the GF slope starts there */
+	double anchor;
+};
+
+static void set_factors(struct deco_state *s, int dt)
+{
+	int i, j;
+
+	for (i = 0; i < VECS; i++) {
+		for (j = 0; j < LANES; j++) {
+			s->n2_factor[i][j] = exp(-dt * M_LN2 / (n2_halftime[i][j] * 60));
+			s->he_factor[i][j] = exp(-dt * M_LN2 / (he_halftime[i][j] * 60));
+		}
+	}
+	s->dt = dt;
+}
+
+/* Saturated with air at the surface, and no oxygen exposure */
+void clear_chain_state(struct chain_state *state)
+{
+	int i;
+
+	for (i = 0; i < COMPARTMENTS; i++) {
+		state->tissues.n2[i] = (SURFACE_PRESSURE - WATER_VAPOR) * AIR_N2;
+		state->tissues.he[i] = 0;
+	}
+	state->cns = 0;
+	state->otu = 0;
+}
+
+/*
+ * Schreiner: breathing a gas whose inert pressure starts at 'gas' and
+ * changes by 'rate' bar per second, a compartment with time constant
+ * 1/k = tau goes from p to
+ *
+ *	(gas - rate*tau) + (p - (gas - rate*tau)) e^-kt + rate*t
+ *
+ * after t seconds. With a zero rate, that's just Haldane.
+ */
+static inline void schreiner(vec *p, const vec *halftime, const vec *factor, double gas, double rate, int dt)
+{
+	vec tau = *halftime * (60 / M_LN2);
+	vec a = gas - rate * tau;
+
+	*p = a + (*p - a) * *factor + rate * dt;
+}
+
+/* 'dt' seconds going from ambient pressure 'p0' to 'p1' (bar) */
+static void load_segment(struct deco_state *s, int dt, double p0, double p1, double fn2, double fhe)
+{
+	double n2 = (p0 - WATER_VAPOR) * fn2, n2_rate = (p1 - p0) * fn2 / dt;
+	double he = (p0 - WATER_VAPOR) * fhe, he_rate = (p1 - p0) * fhe / dt;
+	int i;
+
+	if (dt != s->dt)
+		set_factors(s, dt);
+	for (i = 0; i < VECS; i++) {
+		schreiner(s->t.n2 + i, n2_halftime + i, s->n2_factor + i, n2, n2_rate, dt);
+		schreiner(s->t.he + i, he_halftime + i, s->he_factor + i, he, he_rate, dt);
+	}
+}
+
+/* The gas fractions of what the diver breathes at 'sample' */
+static void sample_gas(struct dive *dive, struct sample *sample, double *fo2, double *fn2, double *fhe)
+{
+	int idx = sample->tankindex;
+	gasmix_t *mix;
+	int o2;
+
+	if (idx < 0 || idx >= MAX_MIXES)
+		idx = 0;
+	mix = dive->gasmix + idx;
+	o2 = mix->o2.permille;
+	if (!o2)
+		o2 = 209;
+	*fo2 = o2 / 1000.0;
+	*fn2 = (1000 - o2 - mix->he.permille) / 1000.0;
+	*fhe = mix->he.permille / 1000.0;
+}
+
+static inline double ambient(depth_t depth)
+{
+	return SURFACE_PRESSURE + depth.mm / MM_PER_BAR;
+}
+
+/*
+ * The mixed-gas a and b of every compartment are the ones for nitrogen
+ * and helium, weighted by how much of each is in there.
+ */
+static inline void mvalue(const struct vec_tissues *t, int i, vec *a, vec *b)
+{
+	vec n2 = t->n2[i], he = t->he[i], sum = n2 + he;
+
+	*a = (n2_a[i] * n2 + he_a[i] * he) / sum;
+	*b = (n2_b[i] * n2 + he_b[i] * he) / sum;
+}
+
+/* The lowest ambient pressure the tissues can take at gradient factor 'gf' */
+static double tolerated(const struct vec_tissues *t, double gf)
+{
+	vec max = { 0 };
+	double p = 0;
+	int i, j;
+
+	for (i = 0; i < VECS; i++) {
+		vec a, b, tol;
+
+		mvalue(t, i, &a, &b);
+		tol = (t->n2[i] + t->he[i] - gf * a) / (gf / b + 1 - gf);
+		for (j = 0; j < LANES; j++)
+			max[j] = tol[j] > max[j] ? tol[j] : max[j];
+	}
+	for (j = 0; j < LANES; j++)
+		p = max[j] > p ? max[j] : p;
+	return p;
+}
+
+/*
+ * The gradient factor goes from gf_low at the deepest ceiling of the
+ * dive to gf_high at the surface, so the ceiling depends on the GF
+ * at the ceiling. Starting from the gf_low ceiling, this only ever
+ * gets shallower, and a few rounds are plenty.
+ */
+static double ceiling(struct deco_state *s)
+{
+	double low = gf_low / 100.0, high = gf_high / 100.0;
+	double p = tolerated(&s->t, low);
+	int i;
+
+	if (p > s->anchor)
+		s->anchor = p;
+	for (i = 0; i < 3 && p > SURFACE_PRESSURE; i++) {
+		double gf = high + (low - high) * (p - SURFACE_PRESSURE) / (s->anchor - SURFACE_PRESSURE);
+		p = tolerated(&s->t, gf);
+	}
+	return p > SURFACE_PRESSURE ? p : SURFACE_PRESSURE;
+}
+
+static void deco_sample(struct deco_state *s, double pamb, struct deco_sample *out)
+{
+	vec gf = { 0 }, sat = { 0 };
+	double maxgf = 0, maxsat = 0;
+	int i, j;
+
+	/* How far into the gradient between ambient and the M-value */
+	for (i = 0; i < VECS; i++) {
+		vec a, b, p = s->t.n2[i] + s->t.he[i];
+		vec g;
+
+		mvalue(&s->t, i, &a, &b);
+		g = (p - pamb) / (pamb / b + a - pamb);
+		for (j = 0; j < LANES; j++) {
+			gf[j] = g[j] > gf[j] ? g[j] : gf[j];
+			sat[j] = p[j] > sat[j] ? p[j] : sat[j];
+		}
+	}
+	for (j = 0; j < LANES; j++) {
+		maxgf = gf[j] > maxgf ? gf[j] : maxgf;
+		maxsat = sat[j] > maxsat ? sat[j] : maxsat;
+	}
+	out->ceiling.mm = (ceiling(s) - SURFACE_PRESSURE) * MM_PER_BAR + 0.5;
+	out->gf = maxgf * 100 + 0.5;
+	out->saturation = maxsat / pamb * 100 + 0.5;
+}
+
+static void start_deco(struct deco_state *s, const struct chain_state *state)
+{
+	memset(s, 0, sizeof(*s));
+	memcpy(s->t.n2, state->tissues.n2, sizeof(s->t.n2));
+	memcpy(s->t.he, state->tissues.he, sizeof(s->t.he));
+}
+
+static void end_deco(const struct deco_state *s, struct chain_state *state)
+{
+	memcpy(state->tissues.n2, s->t.n2, sizeof(s->t.n2));
+	memcpy(state->tissues.he, s->t.he, sizeof(s->t.he));
+}
+
+/*
+ * The NOAA oxygen exposure limits: minutes at a ppO2 of 0.6, 0.7 and
+ * so on up to 1.6 bar. Below 0.5 bar there's no exposure at all.
+ */
+static const double cns_limit[] = {
+	720, 570, 450, 360, 300, 240, 210, 180, 150, 120, 45
+};
+#define NR_CNS_LIMITS (sizeof(cns_limit) / sizeof(cns_limit[0]))
+
+/* 'dt' seconds at a ppO2 of 'po2' bar */
+static void oxygen_exposure(struct chain_state *state, int dt, double po2)
+{
+	double limit, x;
+	int i;
+
+	if (po2 <= 0.5)
+		return;
+	state->otu += dt / 60.0 * pow((po2 - 0.5) / 0.5, 0.83);
+
+	x = (po2 - 0.6) * 10;
+	if (x <= 0)
+		limit = cns_limit[0];
+	else if (x >= NR_CNS_LIMITS - 1)
+		limit = cns_limit[NR_CNS_LIMITS - 1];
+	else {
+		i = x;
+		limit = cns_limit[i] + (cns_limit[i+1] - cns_limit[i]) * (x - i);
+	}
+	state->cns += 100 * dt / (limit * 60);
+}
+
+/*
+ * Take 'state' through a dive, going through the samples from the
+ * surface at time zero. With 'out', that gets what the deco looks
+ * like at every sample.
+ */
+void deco_walk(struct chain_state *state, struct dive *dive, struct deco_sample *out)
+{
+	double p0 = SURFACE_PRESSURE;
+	struct deco_state s;
+	int i, sec = 0;
+
+	start_deco(&s, state);
+	s.anchor = SURFACE_PRESSURE;
+
+	load_samples(dive);
+	for (i = 0; i < dive->samples; i++) {
+		struct sample *sample = dive->sample + i;
+		double p1 = ambient(sample->depth);
+		int dt = sample->time.seconds - sec;
+		double fo2, fn2, fhe;
+
+		if (dt > 0) {
+			sample_gas(dive, sample, &fo2, &fn2, &fhe);
+			load_segment(&s, dt, p0, p1, fn2, fhe);
+			oxygen_exposure(state, dt, (p0 + p1) / 2 * fo2);
+			sec = sample->time.seconds;
+		}
+		p0 = p1;
+		if (out)
+			deco_sample(&s, p1, out + i);
+	}
+
+	end_deco(&s, state);
+}
+
+/*
+ * Breathing air at the surface for 'seconds'. Returns 1 if that was
+ * long enough for nothing to be left of the dives before.
+ */
+int deco_surface(struct chain_state *state, int seconds)
+{
+	struct deco_state s;
+
+	if (seconds <= 0)
+		return 0;
+	if (seconds > MAX_SURFACE_INTERVAL) {
+		clear_chain_state(state);
+		return 1;
+	}
+
+	start_deco(&s, state);
+	load_segment(&s, seconds, SURFACE_PRESSURE, SURFACE_PRESSURE, AIR_N2, 0);
+	end_deco(&s, state);
+
+	state->cns *= exp(-seconds * M_LN2 / CNS_HALFTIME);
+	if (seconds >= OTU_INTERVAL)
+		state->otu = 0;
+	return 0;
+}
+
+/*
+ * The deco at every sample of 'dive', into 'out' (which has room
+ * for all of them), starting from whatever the dives before it
+ * left behind.
+ */
+void deco_dive(struct dive *dive, struct deco_sample *out)
+{
+	struct chain_state state;
+
+	chain_start(dive, &state);
+	deco_walk(&state, dive, out);
+}
@@ -0,0 +1,51 @@
+#ifndef DECO_H
+#define DECO_H
+
+#include "dive.h"
+
+/*
+ * What the deco engine (deco.c) says about a sample of a dive: the
+ * ceiling, how far into the M-value gradient the leading tissue is
+ * (the GF it's at right now), and how saturated the most saturated
+ * tissue is, relative to the ambient pressure.
+ */
+struct deco_sample {
+	depth_t ceiling;
+	int gf;			/* percent */
+	int saturation;		/* percent */
+};
+
+/* Gradient factors, in percent */
+extern int gf_low, gf_high;
+
+#define COMPARTMENTS 16
+
+/* Inert gas in the ZHL-16 compartments, in bar */
+struct tissues {
+	double n2[COMPARTMENTS], he[COMPARTMENTS];
+};
+
+/*
+ * What the dives so far have left behind: the tissue loading, the
+ * oxygen clock (percent of the NOAA CNS limit), and the OTUs since
+ * the last full day out of the water.
+ */
+struct chain_state {
+	struct tissues tissues;
+	double cns, otu;
+};
+
+extern void clear_chain_state(struct chain_state *state);
+extern void deco_walk(struct chain_state *state, struct dive *dive, struct deco_sample *out);
+extern int deco_surface(struct chain_state *state, int seconds);
+extern void deco_dive(struct dive *dive, struct deco_sample *out);
+
+/*
+ * The repetitive dive chain over the dive table, see chain.c: what
+ * each dive starts with, and the CNS and OTU at the end of it.
+ */
+extern void update_chain(void);
+extern void chain_start(struct dive *dive, struct chain_state *state);
+extern int chain_exposure(struct dive *dive, double *cns, double *otu);
+
+#endif
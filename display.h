@@ -9,9 +9,13 @@ extern int selected_dive;
 #define current_dive (get_dive(selected_dive))
 
 extern GtkWidget *dive_profile_frame(void);
+extern void update_plot_info(struct dive *dive);
+extern GtkWidget *dive_overlay_frame(void);
+extern GtkWidget *dive_stats_frame(void);
 extern GtkWidget *dive_info_frame(void);
 extern GtkWidget *extended_dive_info_frame(void);
 extern GtkWidget *create_dive_list(void);
+extern void update_dive_list(void);
 extern void update_dive_info(struct dive *dive);
 extern void repaint_dive(void);
 
@@ -211,6 +211,8 @@ struct dive *try_to_merge(struct dive *a, struct dive *b)
 
 	if (a->when != b->when)
 		return NULL;
+	load_samples(a);
+	load_samples(b);
 
 	alloc_samples = 5;
 	res = malloc(dive_size(alloc_samples));
@@ -219,6 +221,7 @@ struct dive *try_to_merge(struct dive *a, struct dive *b)
 	memset(res, 0, dive_size(alloc_samples));
 
 	res->when = a->when;
+	res->dirty = 1;
 	res->name = merge_text(a->name, b->name);
 	res->location = merge_text(a->location, b->location);
 	res->notes = merge_text(a->notes, b->notes);
@@ -237,5 +240,12 @@ struct dive *try_to_merge(struct dive *a, struct dive *b)
 		}
 		res->gasmix[i] = b->gasmix[i];
 	}
+	for (i = 0; i < MAX_MIXES; i++) {
+		if (a->tank_type[i].size.mliter) {
+			res->tank_type[i] = a->tank_type[i];
+			continue;
+		}
+		res->tank_type[i] = b->tank_type[i];
+	}
 	return merge_samples(res, a, b, 0);
 }
@@ -115,19 +115,143 @@ struct dive {
 	temperature_t airtemp, watertemp;
 	pressure_t beginning_pressure, end_pressure;
 	gasmix_t gasmix[MAX_MIXES];
+	tank_type_t tank_type[MAX_MIXES];	/* by tank index, like the mixes */
+
+	/* Changed since it was last saved to the dive directory? */
+	int dirty;
+
+	/* Samples still packed in a mapped binary log, see binary.c */
+	const void *packed;
+	int packed_samples;
+
 	int samples;
 	struct sample sample[];
 };
 
 extern int verbose;
 
+/*
+ * Once the table has been sorted, we keep it sorted by time, and
+ * 'when' is a dense copy of the dive times in table order. That's
+ * what the time lookups binary-search, so that they don't have to
+ * follow every dive pointer.
+ */
 struct dive_table {
 	int nr, allocated;
+	int sorted;
+	unsigned int generation;
 	struct dive **dives;
+	time_t *when;
 };
 
 extern struct dive_table dive_table;
 
+extern void lock_dive_table(void);
+extern void unlock_dive_table(void);
+extern void record_dive(struct dive *dive);
+extern void sort_dive_table(void);
+extern void merge_dive_table(void);
+extern void replace_dive(int idx, struct dive *dive);
+extern void delete_dive(int idx);
+
+/* The dives from 'start' to 'end' changed: see chain.c */
+extern void chain_changed(time_t start, time_t end);
+
+extern int dive_index_after(time_t when);
+extern int dives_between(time_t start, time_t end, int *first);
+extern int previous_dive_index(time_t when);
+extern int next_dive_index(time_t when);
+extern int dive_table_index(struct dive *dive);
+
+/*
+ * Secondary indexes: dives sorted by max depth, duration and water
+ * temperature (in the native units), and dives by location.
+ */
+enum index_type {
+	INDEX_MAXDEPTH,
+	INDEX_DURATION,
+	INDEX_WATERTEMP,
+	NR_INDEXES
+};
+
+struct index_entry {
+	int value;
+	struct dive *dive;
+};
+
+struct index_iterator {
+	const struct index_entry *pos, *end;
+};
+
+extern void index_dive(struct dive *dive);
+extern void unindex_dive(struct dive *dive);
+extern void index_range(enum index_type type, int min, int max, struct index_iterator *it);
+extern struct dive **dives_at_location(const char *name, int *nr);
+
+static inline struct dive *index_next(struct index_iterator *it)
+{
+	if (it->pos >= it->end)
+		return NULL;
+	return (it->pos++)->dive;
+}
+
+/* Word prefix search over the dive location and notes */
+extern void index_dive_text(struct dive *dive);
+extern void unindex_dive_text(struct dive *dive);
+
+/*
+ * Gas consumption, see sac.c. The gas is what the tank pressures
+ * dropped by times the cylinder size (mbar * ml), and the exposure
+ * is the ambient pressure over time (mbar * s), so the surface air
+ * consumption in ml/min is just gas * 60 / exposure. Both are kept
+ * per 10m depth band too, the last one being everything deeper.
+ */
+#define NR_DEPTH_BANDS 5
+#define DEPTH_BAND 10000
+
+struct sac_info {
+	long long gas, exposure;
+	long long band_gas[NR_DEPTH_BANDS], band_exposure[NR_DEPTH_BANDS];
+};
+
+struct sac_year {
+	int year, dives;
+	long long gas, exposure;
+};
+
+static inline int sac_rate(long long gas, long long exposure)
+{
+	if (exposure <= 0 || gas <= 0)
+		return 0;
+	return gas * 60 / exposure;
+}
+
+extern int dive_sac(struct dive *dive, struct sac_info *info, int *window);
+extern const struct sac_year *sac_years(int *nr);
+extern void index_dive_sac(struct dive *dive);
+extern void unindex_dive_sac(struct dive *dive);
+
+/*
+ * Where a dive went up or down faster than the limits (mm/min), see
+ * rates.c: the time range, and the fastest rate in it, negative when
+ * going up.
+ */
+struct rate_violation {
+	int start, end;
+	int rate;
+};
+
+extern int ascent_limit, descent_limit;
+extern int rate_violations(struct dive *dive, struct rate_violation **list);
+extern int search_dives(const char *query, unsigned char *match);
+
+/* Filter expressions over the dive table, see filter.c */
+struct filter;
+
+extern struct filter *compile_filter(const char *expr, const char **error);
+extern int run_filter(struct filter *filter, unsigned char *match);
+extern void free_filter(struct filter *filter);
+
 static inline struct dive *get_dive(unsigned int nr)
 {
 	if (nr >= dive_table.nr)
@@ -135,11 +259,70 @@ static inline struct dive *get_dive(unsigned int nr)
 	return dive_table.dives[nr];
 }
 
+extern time_t utc_mktime(struct tm *tm);
 extern void parse_xml_init(void);
 extern void parse_xml_file(const char *filename);
 
 extern void flush_dive_info_changes(void);
-extern void save_dives(const char *filename);
+extern int save_dives(const char *filename);
+extern int write_dives(const char *filename);
+extern int write_dives_as(const char *filename, const char *format);
+
+/*
+ * What write_dives_as() would write for 'format', but formatted in
+ * memory, so that it can go to disk after the dive table has been
+ * unlocked again. Not for dive directories.
+ */
+struct membuffer;
+extern int format_dives(const char *format, struct membuffer *b);
+extern int write_formatted_dives(const char *filename, const char *format, struct membuffer *b);
+
+/*
+ * A dive directory has one file per dive, and an index. Saving
+ * to the directory we loaded from (or last saved to) only writes
+ * the dives that are dirty.
+ */
+extern int save_dive_directory(const char *dirname);
+extern void parse_dive_directory(const char *dirname);
+extern const char *dive_directory;
+extern void set_dive_directory(const char *dirname);
+
+/* Threads to save with: 0 means one per CPU, 1 means don't bother */
+extern int save_threads;
+
+/*
+ * The journal: every edit, merge and import gets appended to
+ * "<logfile>.journal" as it happens, and replayed on top of the
+ * log file at startup. See journal.c.
+ */
+extern void open_journal(const char *logfile);
+extern void journal_edit(struct dive *dive);
+extern void journal_merge(struct dive *dive);
+extern void journal_import(const char *filename);
+extern void journal_saved(const char *filename);
+extern void compact_journal(void);
+
+/* The native binary log format, see binary.c */
+extern int parse_binary_file(const char *filename);
+extern int save_binary_file(const char *filename);
+extern void format_binary(struct membuffer *b);
+extern void unpack_samples(struct dive *dive);
+
+/*
+ * Anything that looks at the samples of a dive needs to do this first.
+ * It's fine from any thread: see unpack_samples().
+ */
+static inline void load_samples(struct dive *dive)
+{
+	if (__atomic_load_n(&dive->packed, __ATOMIC_ACQUIRE))
+		unpack_samples(dive);
+}
+
+/* Binary columns or CSV for analytics, see export.c */
+extern int export_dives(const char *dir, int csv);
+
+/* Profile images of every dive, see render.c */
+extern int render_dives(const char *dir, const char *format, int w, int h);
 
 static inline unsigned int dive_size(int samples)
 {
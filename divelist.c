@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "dive.h"
 #include "display.h"
@@ -15,9 +17,346 @@ static void selection_cb(GtkTreeSelection *selection, GtkTreeModel *model)
 
 	gtk_tree_model_get_value(model, &iter, 1, &value);
 	selected_dive = g_value_get_int(&value);
+	update_plot_info(current_dive);
 	repaint_dive();
 }
 
+/*
+ * The dive filter: one byte per dive saying whether it should be
+ * shown in the list. NULL means "show everything".
+ */
+static unsigned char *visible_dives;
+
+static GtkListStore *dive_store;
+static GtkWidget *filter_entry;
+
+static const char filter_hint[] = "Filter, eg: maxdepth > 30m and location ~ reef";
+
+static gboolean dive_visible(GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	int idx;
+
+	if (!visible_dives)
+		return TRUE;
+	gtk_tree_model_get(model, iter, 1, &idx, -1);
+	return idx < dive_table.nr && visible_dives[idx];
+}
+
+static void filter_changed(GtkEditable *entry, GtkTreeModelFilter *filter_model)
+{
+	const char *error;
+	struct filter *filter;
+	unsigned char *visible;
+
+	filter = compile_filter(gtk_entry_get_text(GTK_ENTRY(entry)), &error);
+
+	/* Keep showing the last good filter while it's being typed */
+	if (error) {
+		gtk_widget_set_tooltip_text(GTK_WIDGET(entry), error);
+		return;
+	}
+	gtk_widget_set_tooltip_text(GTK_WIDGET(entry), filter_hint);
+
+	visible = realloc(visible_dives, dive_table.nr + 1);
+	if (!visible)
+		return;
+	visible_dives = visible;
+	run_filter(filter, visible);
+	free_filter(filter);
+
+	gtk_tree_model_filter_refilter(filter_model);
+}
+
+/*
+ * Sparkline thumbnails of the dive profiles in the list.
+ *
+ * A thumbnail only gets asked for when its row is actually on the
+ * screen, and a background thread then draws it from the depths
+ * decimated down to one per pixel column. The row shows nothing
+ * there until it's done, and after that it's cached until the dive
+ * table changes.
+ *
+ * Only the main thread looks at the cache: the thread just gets the
+ * requests and hands back the pixbufs through an idle callback.
+ */
+#define THUMB_WIDTH 64
+#define THUMB_HEIGHT 16
+
+/* Rows scrolled past before their turn just get dropped */
+#define THUMB_QUEUE 64
+
+struct thumbnail {
+	struct dive *dive;
+	unsigned int generation;
+	int queued;
+	GdkPixbuf *pixbuf;
+};
+
+static struct thumbnail *thumbnails;
+static int nr_thumbnails;
+
+struct thumb_request {
+	int idx;
+	struct dive *dive;
+	unsigned int generation;
+	GdkPixbuf *pixbuf;
+};
+
+static struct thumb_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nr, started;
+	struct thumb_request request[THUMB_QUEUE];
+} thumb_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* cairo has premultiplied native-endian ARGB, pixbufs have RGBA */
+static GdkPixbuf *surface_to_pixbuf(cairo_surface_t *surface, int w, int h)
+{
+	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, w, h);
+	unsigned char *src = cairo_image_surface_get_data(surface);
+	unsigned char *dst = gdk_pixbuf_get_pixels(pixbuf);
+	int src_stride = cairo_image_surface_get_stride(surface);
+	int dst_stride = gdk_pixbuf_get_rowstride(pixbuf);
+	int x, y;
+
+	cairo_surface_flush(surface);
+	for (y = 0; y < h; y++) {
+		const unsigned int *in = (const unsigned int *) (src + y * src_stride);
+		unsigned char *out = dst + y * dst_stride;
+
+		for (x = 0; x < w; x++, out += 4) {
+			unsigned int p = in[x], a = p >> 24;
+
+			out[3] = a;
+			if (!a) {
+				out[0] = out[1] = out[2] = 0;
+				continue;
+			}
+			out[0] = ((p >> 16) & 0xff) * 255 / a;
+			out[1] = ((p >> 8) & 0xff) * 255 / a;
+			out[2] = (p & 0xff) * 255 / a;
+		}
+	}
+	return pixbuf;
+}
+
+/* Runs in the thumbnail thread: NULL if the dive went away */
+static GdkPixbuf *render_thumbnail(struct dive *dive, unsigned int generation)
+{
+	int depth[THUMB_WIDTH];
+	int i, maxdepth = 1, endtime = 1;
+	cairo_surface_t *surface;
+	GdkPixbuf *pixbuf;
+	cairo_t *cr;
+
+	lock_dive_table();
+	if (dive_table.generation != generation) {
+		unlock_dive_table();
+		return NULL;
+	}
+	load_samples(dive);
+	for (i = 0; i < dive->samples; i++) {
+		if (dive->sample[i].time.seconds >= endtime)
+			endtime = dive->sample[i].time.seconds + 1;
+	}
+	for (i = 0; i < THUMB_WIDTH; i++)
+		depth[i] = -1;
+	for (i = 0; i < dive->samples; i++) {
+		struct sample *sample = dive->sample + i;
+		int col = (long long) sample->time.seconds * THUMB_WIDTH / endtime;
+		int mm = sample->depth.mm;
+
+		if (col < 0)
+			continue;
+		if (mm > depth[col])
+			depth[col] = mm;
+		if (mm > maxdepth)
+			maxdepth = mm;
+	}
+	unlock_dive_table();
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, THUMB_WIDTH, THUMB_HEIGHT);
+	cr = cairo_create(surface);
+	cairo_set_line_width(cr, 1);
+	cairo_move_to(cr, 0, 0);
+	for (i = 0; i < THUMB_WIDTH; i++) {
+		if (depth[i] >= 0)
+			cairo_line_to(cr, i + 0.5, (double) depth[i] * (THUMB_HEIGHT - 1) / maxdepth);
+	}
+	cairo_line_to(cr, THUMB_WIDTH, 0);
+	cairo_close_path(cr);
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.20);
+	cairo_fill_preserve(cr);
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.80);
+	cairo_stroke(cr);
+	cairo_destroy(cr);
+
+	pixbuf = surface_to_pixbuf(surface, THUMB_WIDTH, THUMB_HEIGHT);
+	cairo_surface_destroy(surface);
+	return pixbuf;
+}
+
+/* Back in the main thread: put the thumbnail in, and redraw its row */
+static gboolean thumbnail_done(gpointer data)
+{
+	struct thumb_request *r = data;
+	struct thumbnail *t = NULL;
+
+	if (r->idx < nr_thumbnails)
+		t = thumbnails + r->idx;
+	if (t && t->dive == r->dive && t->generation == r->generation && !t->pixbuf) {
+		GtkTreePath *path = gtk_tree_path_new_from_indices(r->idx, -1);
+		GtkTreeIter iter;
+
+		t->queued = 0;
+		t->pixbuf = r->pixbuf;
+		if (gtk_tree_model_get_iter(GTK_TREE_MODEL(dive_store), &iter, path))
+			gtk_tree_model_row_changed(GTK_TREE_MODEL(dive_store), path, &iter);
+		gtk_tree_path_free(path);
+	} else if (r->pixbuf) {
+		g_object_unref(r->pixbuf);
+	}
+	free(r);
+	return FALSE;
+}
+
+static void *thumbnail_worker(void *unused)
+{
+	struct thumb_queue *q = &thumb_queue;
+
+	for (;;) {
+		struct thumb_request *r = malloc(sizeof(*r));
+
+		if (!r)
+			exit(1);
+		pthread_mutex_lock(&q->lock);
+		while (!q->nr)
+			pthread_cond_wait(&q->cond, &q->lock);
+		/* Newest first: that's what just scrolled into view */
+		*r = q->request[--q->nr];
+		pthread_mutex_unlock(&q->lock);
+
+		r->pixbuf = render_thumbnail(r->dive, r->generation);
+		g_idle_add(thumbnail_done, r);
+	}
+	return NULL;
+}
+
+static void queue_thumbnail(int idx, struct thumbnail *t)
+{
+	struct thumb_queue *q = &thumb_queue;
+	struct thumb_request dropped = { -1, };
+	struct thumb_request *r;
+
+	pthread_mutex_lock(&q->lock);
+	if (!q->started) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, thumbnail_worker, NULL)) {
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		pthread_detach(thread);
+		q->started = 1;
+	}
+	if (q->nr == THUMB_QUEUE) {
+		dropped = q->request[0];
+		memmove(q->request, q->request + 1, --q->nr * sizeof(*r));
+	}
+	r = q->request + q->nr++;
+	r->idx = idx;
+	r->dive = t->dive;
+	r->generation = t->generation;
+	r->pixbuf = NULL;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	t->queued = 1;
+	if (dropped.idx >= 0 && dropped.idx < nr_thumbnails)
+		thumbnails[dropped.idx].queued = 0;
+}
+
+static void free_thumbnails(void)
+{
+	int i;
+
+	for (i = 0; i < nr_thumbnails; i++) {
+		if (thumbnails[i].pixbuf)
+			g_object_unref(thumbnails[i].pixbuf);
+	}
+	free(thumbnails);
+	thumbnails = NULL;
+	nr_thumbnails = 0;
+}
+
+/* The cache entry for dive 'idx', emptied if the dive table changed */
+static struct thumbnail *get_thumbnail(int idx)
+{
+	struct dive *dive = get_dive(idx);
+	struct thumbnail *t;
+
+	if (!dive)
+		return NULL;
+	if (idx >= nr_thumbnails) {
+		int nr = (dive_table.nr + 32) * 3 / 2;
+
+		thumbnails = realloc(thumbnails, nr * sizeof(*t));
+		if (!thumbnails)
+			exit(1);
+		memset(thumbnails + nr_thumbnails, 0, (nr - nr_thumbnails) * sizeof(*t));
+		nr_thumbnails = nr;
+	}
+	t = thumbnails + idx;
+	if (t->dive != dive || t->generation != dive_table.generation) {
+		if (t->pixbuf)
+			g_object_unref(t->pixbuf);
+		t->dive = dive;
+		t->generation = dive_table.generation;
+		t->queued = 0;
+		t->pixbuf = NULL;
+	}
+	return t;
+}
+
+/*
+ * The tree view also asks for rows it isn't showing, to size them,
+ * so this has to check for itself what's on the screen.
+ */
+static int row_on_screen(GtkTreeView *tree_view, GtkTreeModel *model, GtkTreeIter *iter)
+{
+	GtkTreePath *start, *end, *path;
+	int visible;
+
+	if (!gtk_tree_view_get_visible_range(tree_view, &start, &end))
+		return 0;
+	path = gtk_tree_model_get_path(model, iter);
+	visible = gtk_tree_path_compare(start, path) <= 0 && gtk_tree_path_compare(path, end) <= 0;
+	gtk_tree_path_free(path);
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+	return visible;
+}
+
+static void thumbnail_data_func(GtkTreeViewColumn *col, GtkCellRenderer *renderer,
+	GtkTreeModel *model, GtkTreeIter *iter, gpointer data)
+{
+	GdkPixbuf *pixbuf = NULL;
+	struct thumbnail *t;
+	int idx;
+
+	gtk_tree_model_get(model, iter, 1, &idx, -1);
+	t = get_thumbnail(idx);
+	if (t) {
+		pixbuf = t->pixbuf;
+		if (!pixbuf && !t->queued && row_on_screen(GTK_TREE_VIEW(data), model, iter))
+			queue_thumbnail(idx, t);
+	}
+	g_object_set(renderer, "pixbuf", pixbuf, NULL);
+}
+
 static void fill_dive_list(GtkListStore *store)
 {
 	int i;
@@ -34,23 +373,38 @@ static void fill_dive_list(GtkListStore *store)
 	}
 }
 
+/* The dive table changed under us: refill the list and refilter it */
+void update_dive_list(void)
+{
+	free_thumbnails();
+	gtk_list_store_clear(dive_store);
+	fill_dive_list(dive_store);
+	g_signal_emit_by_name(filter_entry, "changed");
+}
+
 GtkWidget *create_dive_list(void)
 {
-	GtkListStore      *model;
+	GtkListStore      *store;
+	GtkTreeModel      *model;
 	GtkWidget         *tree_view;
 	GtkTreeSelection  *selection;
 	GtkCellRenderer   *renderer;
 	GtkTreeViewColumn *col;
 	GtkWidget         *scroll_window;
+	GtkWidget         *entry;
+	GtkWidget         *vbox;
 
-	model = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_INT);
-	tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(model));
+	store = gtk_list_store_new(2, G_TYPE_STRING, G_TYPE_INT);
+	model = gtk_tree_model_filter_new(GTK_TREE_MODEL(store), NULL);
+	gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(model), dive_visible, NULL, NULL);
+	tree_view = gtk_tree_view_new_with_model(model);
 	selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(tree_view));
 
 	gtk_tree_selection_set_mode(GTK_TREE_SELECTION(selection), GTK_SELECTION_BROWSE);
 	gtk_widget_set_size_request(tree_view, 200, 100);
 
-	fill_dive_list(model);
+	fill_dive_list(store);
+	dive_store = store;
 
 	renderer = gtk_cell_renderer_text_new();
 	col = gtk_tree_view_column_new();
@@ -58,6 +412,14 @@ GtkWidget *create_dive_list(void)
 	gtk_tree_view_column_add_attribute(col, renderer, "text", 0);
 	gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
 
+	/* Fixed size, so that the rows don't move as the thumbnails come in */
+	renderer = gtk_cell_renderer_pixbuf_new();
+	gtk_cell_renderer_set_fixed_size(renderer, THUMB_WIDTH, THUMB_HEIGHT);
+	col = gtk_tree_view_column_new();
+	gtk_tree_view_column_pack_start(col, renderer, FALSE);
+	gtk_tree_view_column_set_cell_data_func(col, renderer, thumbnail_data_func, tree_view, NULL);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
+
 	g_object_set(G_OBJECT(tree_view), "headers-visible", FALSE,
 					  "search-column", 0,
 					  "rules-hint", FALSE,
@@ -70,5 +432,15 @@ GtkWidget *create_dive_list(void)
 		               GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
 	gtk_container_add(GTK_CONTAINER(scroll_window), tree_view);
 
-	return scroll_window;
+	/* Filter expression entry above the list */
+	entry = gtk_entry_new();
+	gtk_widget_set_tooltip_text(entry, filter_hint);
+	g_signal_connect(entry, "changed", G_CALLBACK(filter_changed), model);
+	filter_entry = entry;
+
+	vbox = gtk_vbox_new(FALSE, 3);
+	gtk_box_pack_start(GTK_BOX(vbox), entry, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(vbox), scroll_window, TRUE, TRUE, 0);
+
+	return vbox;
 }
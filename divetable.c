@@ -0,0 +1,313 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "dive.h"
+
+struct dive_table dive_table;
+
+/*
+ * The GUI is single-threaded, but background jobs (like compacting
+ * the journal into a full save) read the dives while the GUI may be
+ * editing them. Anything that changes the dives or the table, and
+ * anything reading them outside the main thread, takes this lock.
+ */
+static pthread_mutex_t dive_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lock_dive_table(void)
+{
+	pthread_mutex_lock(&dive_table_lock);
+}
+
+void unlock_dive_table(void)
+{
+	pthread_mutex_unlock(&dive_table_lock);
+}
+
+static void grow_dive_table(void)
+{
+	int allocated = (dive_table.nr + 32) * 3 / 2;
+	struct dive **dives;
+	time_t *when;
+
+	dives = realloc(dive_table.dives, allocated * sizeof(*dives));
+	if (!dives)
+		exit(1);
+	dive_table.dives = dives;
+	when = realloc(dive_table.when, allocated * sizeof(*when));
+	if (!when)
+		exit(1);
+	dive_table.when = when;
+	dive_table.allocated = allocated;
+}
+
+/*
+ * Sorting the dive table by time.
+ *
+ * We don't just qsort() the dive pointers, because then every
+ * single comparison has to follow two pointers to get at the
+ * dive times, and with a big dive log that's a cache miss each.
+ *
+ * Instead, we extract the times (and the original index) into a
+ * dense array of keys, do a LSD radix sort of that, and then
+ * permute the dive pointers once at the end. The radix sort is
+ * stable, so dives with the same time stay in table order.
+ */
+struct sort_key {
+	unsigned long long when;
+	unsigned int index;
+};
+
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+/* Flip the sign bit, so that negative times sort first */
+static inline unsigned long long sortable_time(time_t when)
+{
+	return (unsigned long long) (long long) when ^ (1ull << 63);
+}
+
+/*
+ * Returns whichever of the two buffers ended up holding the
+ * sorted keys.
+ */
+static struct sort_key *radix_sort(struct sort_key *key, struct sort_key *tmp, unsigned int nr)
+{
+	unsigned int count[RADIX_PASSES][RADIX_SIZE];
+	unsigned int i, pass;
+
+	/* All the histograms in one pass over the keys */
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nr; i++) {
+		unsigned long long when = key[i].when;
+
+		for (pass = 0; pass < RADIX_PASSES; pass++) {
+			count[pass][when & RADIX_MASK]++;
+			when >>= RADIX_BITS;
+		}
+	}
+
+	for (pass = 0; pass < RADIX_PASSES; pass++) {
+		unsigned int shift = pass * RADIX_BITS;
+		unsigned int *c = count[pass];
+		unsigned int sum = 0;
+		struct sort_key *swap;
+
+		/*
+		 * Dive times only differ in the low bytes, so most
+		 * of the passes have all keys in the same bucket.
+		 * Those don't change anything, skip them.
+		 */
+		if (c[(key[0].when >> shift) & RADIX_MASK] == nr)
+			continue;
+
+		for (i = 0; i < RADIX_SIZE; i++) {
+			unsigned int n = c[i];
+			c[i] = sum;
+			sum += n;
+		}
+		for (i = 0; i < nr; i++)
+			tmp[c[(key[i].when >> shift) & RADIX_MASK]++] = key[i];
+
+		swap = key; key = tmp; tmp = swap;
+	}
+	return key;
+}
+
+void sort_dive_table(void)
+{
+	unsigned int i, nr = dive_table.nr;
+	struct dive **dives = dive_table.dives;
+	struct sort_key *buffer, *key;
+	struct dive **sorted;
+
+	dive_table.sorted = 1;
+	if (nr < 2)
+		return;
+
+	buffer = malloc(2 * nr * sizeof(*buffer));
+	sorted = malloc(nr * sizeof(*sorted));
+	if (!buffer || !sorted)
+		exit(1);
+
+	for (i = 0; i < nr; i++) {
+		buffer[i].when = sortable_time(dives[i]->when);
+		buffer[i].index = i;
+	}
+
+	key = radix_sort(buffer, buffer + nr, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct dive *dive = dives[key[i].index];
+		sorted[i] = dive;
+		dive_table.when[i] = dive->when;
+	}
+	memcpy(dives, sorted, nr * sizeof(*sorted));
+	dive_table.generation++;
+	chain_changed(dive_table.when[0], dive_table.when[nr-1]);
+
+	free(sorted);
+	free(buffer);
+}
+
+/*
+ * Return the first index in the sorted table whose dive time
+ * is not before 'when' (or after it, if 'after' is set).
+ */
+static int lookup_time(time_t when, int after)
+{
+	const time_t *array;
+	int lo = 0, hi;
+
+	if (!dive_table.sorted)
+		sort_dive_table();
+
+	array = dive_table.when;
+	hi = dive_table.nr;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		time_t t = array[mid];
+
+		if (t < when || (after && t == when))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Add a dive into the dive_table array
+ *
+ * While we're still loading the initial set of dives, we just
+ * append them, and sort the whole thing once at the end. After
+ * that, new dives get inserted at their proper place, so that
+ * the table and the time index stay sorted without a rebuild.
+ */
+void record_dive(struct dive *dive)
+{
+	int nr = dive_table.nr, idx = nr;
+
+	if (nr >= dive_table.allocated)
+		grow_dive_table();
+
+	dive = fixup_dive(dive);
+	if (dive_table.sorted) {
+		idx = lookup_time(dive->when, 1);
+		memmove(dive_table.dives + idx + 1, dive_table.dives + idx, (nr - idx) * sizeof(struct dive *));
+		memmove(dive_table.when + idx + 1, dive_table.when + idx, (nr - idx) * sizeof(time_t));
+	}
+	dive_table.dives[idx] = dive;
+	dive_table.when[idx] = dive->when;
+	dive_table.nr = nr+1;
+	dive_table.generation++;
+	chain_changed(dive->when, dive->when);
+	index_dive(dive);
+}
+
+/*
+ * Replace the dive at 'idx' with a new one (like the result of
+ * merging it with its neighbor). The caller is responsible for
+ * the old dive, and for the new one being at the same time. The
+ * old dive has to still be valid, so that it can be unindexed.
+ */
+void replace_dive(int idx, struct dive *dive)
+{
+	unindex_dive(dive_table.dives[idx]);
+	index_dive(dive);
+	dive_table.dives[idx] = dive;
+	dive_table.when[idx] = dive->when;
+	dive_table.generation++;
+	chain_changed(dive->when, dive->when);
+}
+
+/* Remove a dive from the table. Again, the caller frees it. */
+void delete_dive(int idx)
+{
+	int nr = dive_table.nr - 1;
+
+	chain_changed(dive_table.when[idx], dive_table.when[idx]);
+	unindex_dive(dive_table.dives[idx]);
+	memmove(dive_table.dives + idx, dive_table.dives + idx + 1, (nr - idx) * sizeof(struct dive *));
+	memmove(dive_table.when + idx, dive_table.when + idx + 1, (nr - idx) * sizeof(time_t));
+	dive_table.nr = nr;
+	dive_table.generation++;
+}
+
+/*
+ * Merge the dives that overlap in time, which are almost always
+ * the same dive imported more than once. The table has to be
+ * sorted for this.
+ */
+void merge_dive_table(void)
+{
+	int i;
+
+	for (i = 1; i < dive_table.nr; i++) {
+		struct dive *prev = dive_table.dives[i-1];
+		struct dive *dive = dive_table.dives[i];
+		struct dive *merged;
+
+		if (prev->when + prev->duration.seconds < dive->when)
+			continue;
+
+		merged = try_to_merge(prev, dive);
+		if (!merged)
+			continue;
+
+		replace_dive(i-1, merged);
+		delete_dive(i);
+		free(prev);
+		free(dive);
+		journal_merge(merged);
+
+		/* Redo the new 'i'th dive */
+		i--;
+	}
+}
+
+/* Where in the table is this dive? -1 if it isn't there */
+int dive_table_index(struct dive *dive)
+{
+	int idx = lookup_time(dive->when, 0);
+
+	for (; idx < dive_table.nr && dive_table.when[idx] == dive->when; idx++) {
+		if (dive_table.dives[idx] == dive)
+			return idx;
+	}
+	return -1;
+}
+
+/* Index of the first dive at or after 'when' (dive_table.nr if none) */
+int dive_index_after(time_t when)
+{
+	return lookup_time(when, 0);
+}
+
+/*
+ * Dives with start times in [start, end): returns the number of
+ * them, and the index of the first one in '*first'.
+ */
+int dives_between(time_t start, time_t end, int *first)
+{
+	int a = lookup_time(start, 0);
+	int b = lookup_time(end, 0);
+
+	*first = a;
+	return b > a ? b - a : 0;
+}
+
+/* The last dive that started strictly before 'when', or -1 */
+int previous_dive_index(time_t when)
+{
+	return lookup_time(when, 0) - 1;
+}
+
+/* The first dive that started strictly after 'when', or -1 */
+int next_dive_index(time_t when)
+{
+	int idx = lookup_time(when, 1);
+
+	return idx < dive_table.nr ? idx : -1;
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dive.h"
+#include "deco.h"
+#include "membuffer.h"
+
+/*
+ * Export for analytics: the samples and the dive headers as
+ * columns, so that nobody has to parse the XML to get at them.
+ *
+ * The binary export writes one file per column into a directory.
+ * Each column file is a 64-byte schema header followed by the
+ * values, fixed-width little-endian:
+ *
+ *	char magic[8]		"DIVECOL\0"
+ *	le32 version
+ *	le32 type		4 or 8: int32 or int64
+ *	le64 count
+ *	char name[24], unit[16]	NUL-padded
+ *
+ * The sample columns are "sample.<field>.col", the dive columns are
+ * "dive.<field>.col". "dive.first_sample.col" has the index of the
+ * first sample of every dive, plus a final entry with the total,
+ * so dive N has samples first_sample[N] .. first_sample[N+1]-1.
+ *
+ * The CSV export goes through the same code, with every column
+ * going into the one "samples.csv" or "dives.csv" file as a row
+ * instead. All values are in the native units.
+ */
+#define COLUMN_MAGIC "DIVECOL"
+#define COLUMN_VERSION 1
+
+#define FLUSH_SIZE (256*1024)
+
+struct column {
+	const char *name, *unit;
+	int offset;
+};
+
+#define SAMPLE(name, unit, field) { name, unit, offsetof(struct sample, field) }
+#define DIVE(name, unit, field) { name, unit, offsetof(struct dive, field) }
+
+static const struct column sample_columns[] = {
+	SAMPLE("time", "s", time.seconds),
+	SAMPLE("depth", "mm", depth.mm),
+	SAMPLE("temperature", "mK", temperature.mkelvin),
+	SAMPLE("pressure", "mbar", tankpressure.mbar),
+	SAMPLE("tankindex", "", tankindex),
+	{ NULL, }
+};
+
+/* The dive columns after "when" and "first_sample" */
+static const struct column dive_columns[] = {
+	DIVE("maxdepth", "mm", maxdepth.mm),
+	DIVE("meandepth", "mm", meandepth.mm),
+	DIVE("duration", "s", duration.seconds),
+	DIVE("surfacetime", "s", surfacetime.seconds),
+	DIVE("visibility", "mm", visibility.mm),
+	DIVE("airtemp", "mK", airtemp.mkelvin),
+	DIVE("watertemp", "mK", watertemp.mkelvin),
+	DIVE("start_pressure", "mbar", beginning_pressure.mbar),
+	DIVE("end_pressure", "mbar", end_pressure.mbar),
+	DIVE("o2", "permille", gasmix[0].o2.permille),
+	DIVE("he", "permille", gasmix[0].he.permille),
+	DIVE("cylinder_size", "ml", tank_type[0].size.mliter),
+	{ NULL, }
+};
+
+#define MAX_COLUMNS 16
+
+/*
+ * One table being written: either a file per column, or one CSV
+ * file with a line per row.
+ */
+struct table {
+	int csv, nr, col;
+	int fd[MAX_COLUMNS];
+	struct membuffer buf[MAX_COLUMNS];
+	int error;
+};
+
+static void put_le(struct membuffer *b, unsigned long long val, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++) {
+		put_char(b, val);
+		val >>= 8;
+	}
+}
+
+static void put_padded(struct membuffer *b, const char *s, int len)
+{
+	int n = strlen(s);
+
+	if (n > len - 1)
+		n = len - 1;
+	put_bytes(b, s, n);
+	while (n++ < len)
+		put_char(b, 0);
+}
+
+static int open_output(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		fprintf(stderr, "Can't create '%s': %s\n", path, strerror(errno));
+	return fd;
+}
+
+/* Add a column to the table: a file of its own, or a CSV field */
+static void add_column(struct table *t, const char *dir, const char *prefix,
+	const char *name, const char *unit, int type, unsigned long long count)
+{
+	struct membuffer *b = t->buf + t->nr;
+	char file[64];
+
+	/* CSV: just the header line, "name_unit" */
+	if (t->csv) {
+		b = t->buf;
+		if (t->nr)
+			put_char(b, ',');
+		put_string(b, name);
+		if (*unit) {
+			put_char(b, '_');
+			put_string(b, unit);
+		}
+		t->nr++;
+		return;
+	}
+
+	snprintf(file, sizeof(file), "%s.%s.col", prefix, name);
+	t->fd[t->nr] = open_output(dir, file);
+	if (t->fd[t->nr] < 0)
+		t->error = 1;
+	put_padded(b, COLUMN_MAGIC, 8);
+	put_le(b, COLUMN_VERSION, 4);
+	put_le(b, type, 4);
+	put_le(b, count, 8);
+	put_padded(b, name, 24);
+	put_padded(b, unit, 16);
+	t->nr++;
+}
+
+static void flush_column(struct table *t, int col)
+{
+	if (t->fd[col] >= 0 && write_buffer(t->buf + col, t->fd[col]) < 0) {
+		fprintf(stderr, "Export write failed: %s\n", strerror(errno));
+		t->error = 1;
+	}
+	t->buf[col].len = 0;
+}
+
+/* The next value of the current row */
+static void put_value(struct table *t, long long val, int bytes)
+{
+	struct membuffer *b;
+
+	if (!t->csv) {
+		b = t->buf + t->col;
+		put_le(b, val, bytes);
+		if (b->len >= FLUSH_SIZE)
+			flush_column(t, t->col);
+		t->col = (t->col + 1) % t->nr;
+		return;
+	}
+
+	b = t->buf;
+	put_char(b, t->col ? ',' : '\n');
+	if (val < 0) {
+		put_char(b, '-');
+		val = -val;
+	}
+	if (val > 0xffffffffu)
+		put_format(b, "%lld", val);
+	else
+		put_uint(b, val);
+	if (++t->col == t->nr) {
+		t->col = 0;
+		if (b->len >= FLUSH_SIZE)
+			flush_column(t, 0);
+	}
+}
+
+static void put_columns(struct table *t, const void *p, const struct column *col)
+{
+	for (; col->name; col++)
+		put_value(t, *(const int *) ((const char *) p + col->offset), 4);
+}
+
+static int end_table(struct table *t)
+{
+	int i;
+
+	if (t->csv)
+		put_char(t->buf, '\n');
+	for (i = 0; i < (t->csv ? 1 : t->nr); i++) {
+		flush_column(t, i);
+		if (t->fd[i] >= 0 && close(t->fd[i]) < 0)
+			t->error = 1;
+		free_buffer(t->buf + i);
+	}
+	return t->error ? -1 : 0;
+}
+
+static void start_table(struct table *t, int csv, const char *dir, const char *csvname)
+{
+	memset(t, 0, sizeof(*t));
+	t->csv = csv;
+	if (csv) {
+		t->fd[0] = open_output(dir, csvname);
+		if (t->fd[0] < 0)
+			t->error = 1;
+	}
+}
+
+static int export_samples(const char *dir, int csv, unsigned long long samples)
+{
+	const struct column *col;
+	struct table t;
+	int i, j;
+
+	start_table(&t, csv, dir, "samples.csv");
+	add_column(&t, dir, "sample", "dive", "", 4, samples);
+	for (col = sample_columns; col->name; col++)
+		add_column(&t, dir, "sample", col->name, col->unit, 4, samples);
+
+	for (i = 0; i < dive_table.nr && !t.error; i++) {
+		struct dive *dive = dive_table.dives[i];
+
+		for (j = 0; j < dive->samples; j++) {
+			put_value(&t, i, 4);
+			put_columns(&t, dive->sample + j, sample_columns);
+		}
+	}
+	return end_table(&t);
+}
+
+static int export_dive_headers(const char *dir, int csv)
+{
+	const struct column *col;
+	struct table t;
+	struct table offsets;
+	unsigned long long first = 0;
+	int i, nr = dive_table.nr;
+
+	start_table(&t, csv, dir, "dives.csv");
+	add_column(&t, dir, "dive", "when", "s", 8, nr);
+	for (col = dive_columns; col->name; col++)
+		add_column(&t, dir, "dive", col->name, col->unit, 4, nr);
+
+	/* The dive offsets don't fit the CSV rows, they have nr+1 values */
+	memset(&offsets, 0, sizeof(offsets));
+	if (!csv)
+		add_column(&offsets, dir, "dive", "first_sample", "", 8, nr + 1);
+	else
+		put_string(t.buf, ",first_sample");
+
+	for (i = 0; i < nr && !t.error; i++) {
+		struct dive *dive = dive_table.dives[i];
+
+		put_value(&t, dive->when, 8);
+		put_columns(&t, dive, dive_columns);
+		if (csv)
+			put_format(t.buf, ",%llu", first);
+		else
+			put_value(&offsets, first, 8);
+		first += dive->samples;
+	}
+	if (!csv) {
+		put_value(&offsets, first, 8);
+		if (end_table(&offsets) < 0)
+			t.error = 1;
+	}
+	return end_table(&t);
+}
+
+/*
+ * Export the dive table into directory 'dir', as binary columns or
+ * as CSV. Returns 0 on success.
+ */
+int export_dives(const char *dir, int csv)
+{
+	unsigned long long samples = 0;
+	int i;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	/* The column headers need the counts up front */
+	for (i = 0; i < dive_table.nr; i++) {
+		struct dive *dive = dive_table.dives[i];
+
+		load_samples(dive);
+		samples += dive->samples;
+	}
+
+	/* That fills in the surface intervals */
+	update_chain();
+
+	if (export_dive_headers(dir, csv) < 0)
+		return -1;
+	return export_samples(dir, csv, samples);
+}
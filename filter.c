@@ -0,0 +1,691 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "dive.h"
+
+/*
+ * Dive filter expressions.
+ *
+ * Things like
+ *
+ *	maxdepth > 30m and duration < 40min and location ~ 'reef'
+ *
+ * get parsed once into a little program, which is then run over
+ * the whole dive table a column at a time: each comparison fills
+ * in a byte per dive from a dense snapshot of the dive header
+ * values, and "and"/"or"/"not" just combine those byte arrays.
+ * So the inner loops are trivial loops over ints, and there's no
+ * per-dive interpretation overhead at all.
+ *
+ * Comparisons on fields that have an index (the secondary indexes
+ * and the time index) use that instead of scanning the column when
+ * the index says only a few dives can match. And "text" looks up
+ * word prefixes in the full-text index of the location and notes.
+ *
+ * Unrecorded values (zero) never match a comparison.
+ */
+enum filter_field {
+	FIELD_MAXDEPTH,
+	FIELD_MEANDEPTH,
+	FIELD_DURATION,
+	FIELD_WATERTEMP,
+	FIELD_AIRTEMP,
+	NR_COLUMNS,
+
+	/* These aren't columns */
+	FIELD_DATE = NR_COLUMNS,
+	FIELD_LOCATION,
+	FIELD_NOTES,
+	FIELD_TEXT,
+};
+
+enum filter_unit { DEPTH, TIME, TEMPERATURE, DATE, TEXT };
+
+static const struct field_desc {
+	const char *name;
+	enum filter_field field;
+	enum filter_unit unit;
+} fields[] = {
+	{ "maxdepth", FIELD_MAXDEPTH, DEPTH },
+	{ "depth", FIELD_MAXDEPTH, DEPTH },
+	{ "meandepth", FIELD_MEANDEPTH, DEPTH },
+	{ "duration", FIELD_DURATION, TIME },
+	{ "watertemp", FIELD_WATERTEMP, TEMPERATURE },
+	{ "temp", FIELD_WATERTEMP, TEMPERATURE },
+	{ "airtemp", FIELD_AIRTEMP, TEMPERATURE },
+	{ "date", FIELD_DATE, DATE },
+	{ "location", FIELD_LOCATION, TEXT },
+	{ "notes", FIELD_NOTES, TEXT },
+	{ "text", FIELD_TEXT, TEXT },
+	{ NULL, }
+};
+
+enum filter_cmp { CMP_LT, CMP_LE, CMP_GT, CMP_GE, CMP_EQ, CMP_NE, CMP_MATCH };
+
+enum filter_opcode { OP_COMPARE, OP_DATE, OP_TEXT, OP_AND, OP_OR, OP_NOT };
+
+struct filter_insn {
+	enum filter_opcode op;
+	enum filter_field field;
+	enum filter_cmp cmp;
+	int value;
+	time_t start, end;
+	char *text;
+};
+
+struct filter {
+	int nr, allocated;
+	int depth, maxdepth;
+	struct filter_insn *insn;
+};
+
+/*
+ * Parsing. Plain recursive descent straight off the string:
+ *
+ *	expr	= term { "or" term }
+ *	term	= factor { "and" factor }
+ *	factor	= "not" factor | "(" expr ")" | field op value
+ */
+struct parse_state {
+	const char *p;
+	const char *error;
+	struct filter *filter;
+};
+
+static void skip_space(struct parse_state *s)
+{
+	while (isspace(*s->p))
+		s->p++;
+}
+
+static int parse_word(struct parse_state *s, const char *word)
+{
+	int len = strlen(word);
+
+	skip_space(s);
+	if (strncasecmp(s->p, word, len) || isalnum(s->p[len]))
+		return 0;
+	s->p += len;
+	return 1;
+}
+
+static int parse_char(struct parse_state *s, char c)
+{
+	skip_space(s);
+	if (*s->p != c)
+		return 0;
+	s->p++;
+	return 1;
+}
+
+static struct filter_insn *emit(struct parse_state *s, enum filter_opcode op)
+{
+	struct filter *f = s->filter;
+	struct filter_insn *insn;
+
+	if (f->nr >= f->allocated) {
+		int allocated = (f->nr + 8) * 3 / 2;
+		insn = realloc(f->insn, allocated * sizeof(*insn));
+		if (!insn)
+			exit(1);
+		f->insn = insn;
+		f->allocated = allocated;
+	}
+	insn = f->insn + f->nr++;
+	memset(insn, 0, sizeof(*insn));
+	insn->op = op;
+
+	/* Keep track of how many result arrays we need */
+	switch (op) {
+	case OP_AND: case OP_OR:
+		f->depth--;
+		break;
+	case OP_NOT:
+		break;
+	default:
+		if (++f->depth > f->maxdepth)
+			f->maxdepth = f->depth;
+	}
+	return insn;
+}
+
+static const struct field_desc *parse_field(struct parse_state *s)
+{
+	const struct field_desc *desc;
+
+	for (desc = fields; desc->name; desc++) {
+		if (parse_word(s, desc->name))
+			return desc;
+	}
+	s->error = "Unknown field";
+	return NULL;
+}
+
+static int parse_cmp(struct parse_state *s, enum filter_cmp *cmp)
+{
+	const char *p;
+
+	skip_space(s);
+	p = s->p;
+	switch (*p++) {
+	case '<':
+		*cmp = CMP_LT;
+		if (*p == '=') {
+			*cmp = CMP_LE;
+			p++;
+		}
+		break;
+	case '>':
+		*cmp = CMP_GT;
+		if (*p == '=') {
+			*cmp = CMP_GE;
+			p++;
+		}
+		break;
+	case '=':
+		*cmp = CMP_EQ;
+		if (*p == '=')
+			p++;
+		break;
+	case '!':
+		if (*p++ != '=')
+			goto bad;
+		*cmp = CMP_NE;
+		break;
+	case '~':
+		*cmp = CMP_MATCH;
+		break;
+	default:
+		goto bad;
+	}
+	s->p = p;
+	return 1;
+bad:
+	s->error = "Expected a comparison";
+	return 0;
+}
+
+static char *parse_string(struct parse_state *s)
+{
+	const char *start;
+	char quote, *res;
+	int len;
+
+	skip_space(s);
+	quote = *s->p;
+	if (quote != '\'' && quote != '"') {
+		/* Allow a bare word */
+		start = s->p;
+		while (isalnum(*s->p))
+			s->p++;
+		len = s->p - start;
+	} else {
+		start = ++s->p;
+		while (*s->p && *s->p != quote)
+			s->p++;
+		if (!*s->p) {
+			s->error = "Unterminated string";
+			return NULL;
+		}
+		len = s->p++ - start;
+	}
+	if (!len) {
+		s->error = "Expected a string";
+		return NULL;
+	}
+	res = malloc(len + 1);
+	if (!res)
+		exit(1);
+	memcpy(res, start, len);
+	res[len] = 0;
+	return res;
+}
+
+/* Numbers are turned into our native units */
+static int parse_number(struct parse_state *s, enum filter_unit unit, int *res)
+{
+	char *end;
+	double val;
+
+	skip_space(s);
+	val = strtod(s->p, &end);
+	if (end == s->p) {
+		s->error = "Expected a number";
+		return 0;
+	}
+	s->p = end;
+
+	switch (unit) {
+	case DEPTH:
+		if (parse_word(s, "ft")) {
+			val *= 304.8;
+			break;
+		}
+		parse_word(s, "m");
+		val *= 1000;
+		break;
+	case TIME:
+		if (parse_word(s, "s") || parse_word(s, "sec"))
+			break;
+		if (parse_word(s, "h")) {
+			val *= 3600;
+			break;
+		}
+		parse_word(s, "min");
+		val *= 60;
+		break;
+	case TEMPERATURE:
+		if (parse_word(s, "F")) {
+			val = (val + 459.67) * 5000 / 9;
+			break;
+		}
+		parse_word(s, "C");
+		val = (val + 273.15) * 1000;
+		break;
+	default:
+		break;
+	}
+	*res = val + 0.5;
+	return 1;
+}
+
+/* A day: 2011-03-22. Matches the dives that start that day */
+static int parse_date(struct parse_state *s, time_t *start)
+{
+	int y, m, d, n = 0;
+	struct tm tm;
+
+	skip_space(s);
+	if (sscanf(s->p, "%d-%d-%d%n", &y, &m, &d, &n) != 3) {
+		s->error = "Expected a date";
+		return 0;
+	}
+	s->p += n;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = y;
+	tm.tm_mon = m-1;
+	tm.tm_mday = d;
+	*start = utc_mktime(&tm);
+	return *start != -1;
+}
+
+static int parse_comparison(struct parse_state *s)
+{
+	const struct field_desc *desc;
+	struct filter_insn *insn;
+	enum filter_cmp cmp;
+	int value;
+	time_t day;
+	char *text;
+
+	desc = parse_field(s);
+	if (!desc || !parse_cmp(s, &cmp))
+		return 0;
+
+	switch (desc->unit) {
+	case TEXT:
+		if (cmp != CMP_MATCH && cmp != CMP_EQ && cmp != CMP_NE) {
+			s->error = "Text can only be compared with ~, = or !=";
+			return 0;
+		}
+		text = parse_string(s);
+		if (!text)
+			return 0;
+		insn = emit(s, OP_TEXT);
+		insn->text = text;
+		break;
+	case DATE:
+		if (cmp == CMP_MATCH || !parse_date(s, &day))
+			goto bad;
+		insn = emit(s, OP_DATE);
+		/* Turn it into a [start, end) time range */
+		insn->start = LONG_MIN;
+		insn->end = LONG_MAX;
+		switch (cmp) {
+		case CMP_LT: insn->end = day; break;
+		case CMP_LE: insn->end = day + 86400; break;
+		case CMP_GT: insn->start = day + 86400; break;
+		case CMP_GE: insn->start = day; break;
+		default: insn->start = day; insn->end = day + 86400; break;
+		}
+		break;
+	default:
+		if (cmp == CMP_MATCH || !parse_number(s, desc->unit, &value))
+			goto bad;
+		insn = emit(s, OP_COMPARE);
+		insn->value = value;
+		break;
+	}
+	insn->field = desc->field;
+	insn->cmp = cmp;
+
+	/* "Not that day" */
+	if (desc->unit == DATE && cmp == CMP_NE)
+		emit(s, OP_NOT);
+	return 1;
+
+bad:
+	if (!s->error)
+		s->error = "Bad comparison";
+	return 0;
+}
+
+static int parse_expr(struct parse_state *s);
+
+static int parse_factor(struct parse_state *s)
+{
+	if (parse_word(s, "not")) {
+		if (!parse_factor(s))
+			return 0;
+		emit(s, OP_NOT);
+		return 1;
+	}
+	if (parse_char(s, '(')) {
+		if (!parse_expr(s))
+			return 0;
+		if (!parse_char(s, ')')) {
+			s->error = "Missing ')'";
+			return 0;
+		}
+		return 1;
+	}
+	return parse_comparison(s);
+}
+
+static int parse_term(struct parse_state *s)
+{
+	if (!parse_factor(s))
+		return 0;
+	while (parse_word(s, "and")) {
+		if (!parse_factor(s))
+			return 0;
+		emit(s, OP_AND);
+	}
+	return 1;
+}
+
+static int parse_expr(struct parse_state *s)
+{
+	if (!parse_term(s))
+		return 0;
+	while (parse_word(s, "or")) {
+		if (!parse_term(s))
+			return 0;
+		emit(s, OP_OR);
+	}
+	return 1;
+}
+
+void free_filter(struct filter *filter)
+{
+	int i;
+
+	if (!filter)
+		return;
+	for (i = 0; i < filter->nr; i++)
+		free(filter->insn[i].text);
+	free(filter->insn);
+	free(filter);
+}
+
+/*
+ * Returns NULL for an empty expression (match everything) or a
+ * bad one, in which case '*error' says what was wrong with it.
+ */
+struct filter *compile_filter(const char *expr, const char **error)
+{
+	struct parse_state s = { expr, NULL, NULL };
+
+	*error = NULL;
+	skip_space(&s);
+	if (!*s.p)
+		return NULL;
+
+	s.filter = calloc(1, sizeof(struct filter));
+	if (!s.filter)
+		exit(1);
+	if (parse_expr(&s)) {
+		skip_space(&s);
+		if (!*s.p)
+			return s.filter;
+		s.error = "Junk at end of filter";
+	}
+	*error = s.error;
+	free_filter(s.filter);
+	return NULL;
+}
+
+/*
+ * The column snapshot of the dive header values, rebuilt when
+ * the dive table has changed since the last time.
+ */
+static struct dive_columns {
+	int nr, allocated;
+	unsigned int generation;
+	int *column[NR_COLUMNS];
+} columns = { .generation = -1 };
+
+static void update_columns(void)
+{
+	int i, nr = dive_table.nr;
+
+	if (columns.generation == dive_table.generation && columns.nr == nr)
+		return;
+
+	if (nr > columns.allocated) {
+		for (i = 0; i < NR_COLUMNS; i++) {
+			int *col = realloc(columns.column[i], nr * sizeof(int));
+			if (!col)
+				exit(1);
+			columns.column[i] = col;
+		}
+		columns.allocated = nr;
+	}
+	for (i = 0; i < nr; i++) {
+		struct dive *dive = dive_table.dives[i];
+
+		columns.column[FIELD_MAXDEPTH][i] = dive->maxdepth.mm;
+		columns.column[FIELD_MEANDEPTH][i] = dive->meandepth.mm;
+		columns.column[FIELD_DURATION][i] = dive->duration.seconds;
+		columns.column[FIELD_WATERTEMP][i] = dive->watertemp.mkelvin;
+		columns.column[FIELD_AIRTEMP][i] = dive->airtemp.mkelvin;
+	}
+	columns.nr = nr;
+	columns.generation = dive_table.generation;
+}
+
+#define COMPARE_LOOP(op) \
+	for (i = 0; i < nr; i++) \
+		res[i] = (col[i] != 0) & (col[i] op value); \
+	break
+
+static void compare_column(const int *col, enum filter_cmp cmp, int value, unsigned char *res, int nr)
+{
+	int i;
+
+	switch (cmp) {
+	case CMP_LT: COMPARE_LOOP(<);
+	case CMP_LE: COMPARE_LOOP(<=);
+	case CMP_GT: COMPARE_LOOP(>);
+	case CMP_GE: COMPARE_LOOP(>=);
+	case CMP_EQ: COMPARE_LOOP(==);
+	case CMP_NE: COMPARE_LOOP(!=);
+	default:
+		memset(res, 0, nr);
+	}
+}
+
+/*
+ * If there's an index for the field, and it says that only a
+ * small fraction of the dives can match, use it instead of the
+ * column scan.
+ */
+static int compare_index(const struct filter_insn *insn, unsigned char *res, int nr)
+{
+	struct index_iterator it;
+	enum index_type type;
+	int min = INT_MIN, max = INT_MAX;
+	struct dive *dive;
+
+	switch (insn->field) {
+	case FIELD_MAXDEPTH: type = INDEX_MAXDEPTH; break;
+	case FIELD_DURATION: type = INDEX_DURATION; break;
+	case FIELD_WATERTEMP: type = INDEX_WATERTEMP; break;
+	default:
+		return 0;
+	}
+
+	switch (insn->cmp) {
+	case CMP_LT: max = insn->value - 1; break;
+	case CMP_LE: max = insn->value; break;
+	case CMP_GT: min = insn->value + 1; break;
+	case CMP_GE: min = insn->value; break;
+	case CMP_EQ: min = max = insn->value; break;
+	default:
+		return 0;
+	}
+
+	index_range(type, min, max, &it);
+	if ((it.end - it.pos) * 16 > nr)
+		return 0;
+
+	memset(res, 0, nr);
+	while ((dive = index_next(&it)) != NULL) {
+		int idx = dive_table_index(dive);
+		if (idx >= 0)
+			res[idx] = 1;
+	}
+	return 1;
+}
+
+/* The table is sorted by time, so a time range is a range of dives */
+static void compare_date(const struct filter_insn *insn, unsigned char *res, int nr)
+{
+	int first, count;
+
+	count = dives_between(insn->start, insn->end, &first);
+	memset(res, 0, nr);
+	memset(res + first, 1, count);
+}
+
+static int match_text(const char *text, const char *pattern)
+{
+	int len = strlen(pattern);
+
+	if (!text)
+		return 0;
+	for (; *text; text++) {
+		if (!strncasecmp(text, pattern, len))
+			return 1;
+	}
+	return 0;
+}
+
+static void compare_text(const struct filter_insn *insn, unsigned char *res, int nr)
+{
+	int i;
+
+	/* "text ~ 'lin bud'": word prefixes anywhere in location or notes */
+	if (insn->field == FIELD_TEXT) {
+		search_dives(insn->text, res);
+		if (insn->cmp == CMP_NE) {
+			for (i = 0; i < nr; i++)
+				res[i] ^= 1;
+		}
+		return;
+	}
+
+	/* Exact location matches can use the location index */
+	if (insn->field == FIELD_LOCATION && insn->cmp == CMP_EQ) {
+		int n;
+		struct dive **dives = dives_at_location(insn->text, &n);
+
+		memset(res, 0, nr);
+		for (i = 0; i < n; i++) {
+			int idx = dive_table_index(dives[i]);
+			if (idx >= 0)
+				res[idx] = 1;
+		}
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct dive *dive = dive_table.dives[i];
+		const char *text = insn->field == FIELD_LOCATION ? dive->location : dive->notes;
+
+		if (insn->cmp == CMP_MATCH)
+			res[i] = match_text(text, insn->text);
+		else
+			res[i] = !strcmp(text ? : "", insn->text) ^ (insn->cmp == CMP_NE);
+	}
+}
+
+/*
+ * Run the filter over the dive table: 'match' gets one byte per
+ * dive in table order. Returns the number of matching dives.
+ */
+int run_filter(struct filter *filter, unsigned char *match)
+{
+	int i, nr = dive_table.nr, sp = 0, count = 0;
+	unsigned char *stack[filter ? filter->maxdepth : 1];
+	unsigned char *buffer;
+
+	if (!filter) {
+		memset(match, 1, nr);
+		return nr;
+	}
+
+	if (!dive_table.sorted)
+		sort_dive_table();
+	update_columns();
+
+	/* The bottom of the stack is the result array itself */
+	buffer = malloc(filter->maxdepth * nr + 1);
+	if (!buffer)
+		exit(1);
+	stack[0] = match;
+	for (i = 1; i < filter->maxdepth; i++)
+		stack[i] = buffer + i * nr;
+
+	for (i = 0; i < filter->nr; i++) {
+		const struct filter_insn *insn = filter->insn + i;
+		unsigned char *a, *b;
+		int j;
+
+		switch (insn->op) {
+		case OP_COMPARE:
+			a = stack[sp++];
+			if (!compare_index(insn, a, nr))
+				compare_column(columns.column[insn->field], insn->cmp, insn->value, a, nr);
+			break;
+		case OP_DATE:
+			compare_date(insn, stack[sp++], nr);
+			break;
+		case OP_TEXT:
+			compare_text(insn, stack[sp++], nr);
+			break;
+		case OP_AND:
+			a = stack[sp-2]; b = stack[--sp];
+			for (j = 0; j < nr; j++)
+				a[j] &= b[j];
+			break;
+		case OP_OR:
+			a = stack[sp-2]; b = stack[--sp];
+			for (j = 0; j < nr; j++)
+				a[j] |= b[j];
+			break;
+		case OP_NOT:
+			a = stack[sp-1];
+			for (j = 0; j < nr; j++)
+				a[j] ^= 1;
+			break;
+		}
+	}
+	free(buffer);
+
+	for (i = 0; i < nr; i++)
+		count += match[i];
+	return count;
+}
@@ -0,0 +1,258 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "dive.h"
+
+/*
+ * Secondary indexes over the dive table.
+ *
+ * The numeric ones are just arrays of (value, dive) pairs kept
+ * sorted by value, so a range query is two binary searches and
+ * then walking the entries in between. Inserting and removing
+ * is a memmove, which is fine: it's a few pointers per dive, and
+ * it happens on imports and edits, not on queries.
+ *
+ * We point to the dives rather than remembering table indexes,
+ * since those shift around whenever a dive gets inserted into
+ * the middle of the table.
+ *
+ * Zero values aren't indexed: they mean "not recorded", and a
+ * dive without a water temperature isn't a 0 K dive.
+ */
+struct value_index {
+	int nr, allocated;
+	struct index_entry *entry;
+};
+
+static struct value_index value_index[NR_INDEXES];
+
+static int dive_value(struct dive *dive, enum index_type type)
+{
+	switch (type) {
+	case INDEX_MAXDEPTH:
+		return dive->maxdepth.mm;
+	case INDEX_DURATION:
+		return dive->duration.seconds;
+	case INDEX_WATERTEMP:
+		return dive->watertemp.mkelvin;
+	default:
+		return 0;
+	}
+}
+
+/* First entry with a value not less than 'value' (or greater, with 'after') */
+static int lookup_value(struct value_index *index, int value, int after)
+{
+	const struct index_entry *entry = index->entry;
+	int lo = 0, hi = index->nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int v = entry[mid].value;
+
+		if (v < value || (after && v == value))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void add_value(struct value_index *index, int value, struct dive *dive)
+{
+	int nr = index->nr, pos;
+	struct index_entry *entry = index->entry;
+
+	if (nr >= index->allocated) {
+		int allocated = (nr + 32) * 3 / 2;
+		entry = realloc(entry, allocated * sizeof(*entry));
+		if (!entry)
+			exit(1);
+		index->entry = entry;
+		index->allocated = allocated;
+	}
+	pos = lookup_value(index, value, 1);
+	memmove(entry + pos + 1, entry + pos, (nr - pos) * sizeof(*entry));
+	entry[pos].value = value;
+	entry[pos].dive = dive;
+	index->nr = nr + 1;
+}
+
+static void remove_value(struct value_index *index, int value, struct dive *dive)
+{
+	int pos = lookup_value(index, value, 0);
+	struct index_entry *entry = index->entry;
+
+	for (; pos < index->nr && entry[pos].value == value; pos++) {
+		if (entry[pos].dive != dive)
+			continue;
+		index->nr--;
+		memmove(entry + pos, entry + pos + 1, (index->nr - pos) * sizeof(*entry));
+		return;
+	}
+}
+
+/* All dives with min <= value <= max, in value order */
+void index_range(enum index_type type, int min, int max, struct index_iterator *it)
+{
+	struct value_index *index = value_index + type;
+	int start = lookup_value(index, min, 0);
+	int end = lookup_value(index, max, 1);
+
+	it->pos = index->entry + start;
+	it->end = index->entry + (end > start ? end : start);
+}
+
+/*
+ * Locations are free-form text, so we just intern them in a hash
+ * table (after trimming whitespace) and keep the list of dives
+ * that were at each one. Same spelling, same location.
+ */
+struct location {
+	struct location *next;
+	unsigned int hash;
+	int nr, allocated;
+	struct dive **dives;
+	char name[];
+};
+
+#define LOCATION_HASH_BITS 10
+#define LOCATION_HASH_SIZE (1 << LOCATION_HASH_BITS)
+
+static struct location *location_hash[LOCATION_HASH_SIZE];
+
+static unsigned int location_len(const char **name)
+{
+	const char *p = *name;
+	unsigned int len;
+
+	while (isspace(*p))
+		p++;
+	len = strlen(p);
+	while (len && isspace(p[len-1]))
+		len--;
+	*name = p;
+	return len;
+}
+
+static unsigned int hash_name(const char *name, unsigned int len)
+{
+	unsigned int hash = 0;
+
+	while (len--)
+		hash = hash * 31 + (unsigned char) *name++;
+	return hash;
+}
+
+static struct location *lookup_location(const char *name, int create)
+{
+	struct location *loc, **pp;
+	unsigned int len, hash;
+
+	if (!name)
+		return NULL;
+	len = location_len(&name);
+	if (!len)
+		return NULL;
+
+	hash = hash_name(name, len);
+	pp = location_hash + (hash & (LOCATION_HASH_SIZE - 1));
+	for (loc = *pp; loc; loc = loc->next) {
+		if (loc->hash == hash && !memcmp(loc->name, name, len) && !loc->name[len])
+			return loc;
+	}
+	if (!create)
+		return NULL;
+
+	loc = malloc(sizeof(*loc) + len + 1);
+	if (!loc)
+		exit(1);
+	memset(loc, 0, sizeof(*loc));
+	loc->hash = hash;
+	memcpy(loc->name, name, len);
+	loc->name[len] = 0;
+	loc->next = *pp;
+	*pp = loc;
+	return loc;
+}
+
+static void add_location(struct dive *dive)
+{
+	struct location *loc = lookup_location(dive->location, 1);
+	int nr;
+
+	if (!loc)
+		return;
+	nr = loc->nr;
+	if (nr >= loc->allocated) {
+		int allocated = (nr + 8) * 3 / 2;
+		struct dive **dives = realloc(loc->dives, allocated * sizeof(*dives));
+		if (!dives)
+			exit(1);
+		loc->dives = dives;
+		loc->allocated = allocated;
+	}
+	loc->dives[nr] = dive;
+	loc->nr = nr + 1;
+}
+
+static void remove_location(struct dive *dive)
+{
+	struct location *loc = lookup_location(dive->location, 0);
+	int i;
+
+	if (!loc)
+		return;
+	for (i = 0; i < loc->nr; i++) {
+		if (loc->dives[i] != dive)
+			continue;
+		loc->dives[i] = loc->dives[--loc->nr];
+		return;
+	}
+}
+
+/* The dives at a location, in no particular order */
+struct dive **dives_at_location(const char *name, int *nr)
+{
+	struct location *loc = lookup_location(name, 0);
+
+	if (!loc) {
+		*nr = 0;
+		return NULL;
+	}
+	*nr = loc->nr;
+	return loc->dives;
+}
+
+/*
+ * These get called whenever a dive enters or leaves the table,
+ * and around edits of the indexed fields: unindex the dive with
+ * the old values, change it, and index it again.
+ */
+void index_dive(struct dive *dive)
+{
+	int i;
+
+	for (i = 0; i < NR_INDEXES; i++) {
+		int value = dive_value(dive, i);
+		if (value)
+			add_value(value_index + i, value, dive);
+	}
+	add_location(dive);
+	index_dive_text(dive);
+	index_dive_sac(dive);
+}
+
+void unindex_dive(struct dive *dive)
+{
+	int i;
+
+	for (i = 0; i < NR_INDEXES; i++) {
+		int value = dive_value(dive, i);
+		if (value)
+			remove_value(value_index + i, value, dive);
+	}
+	remove_location(dive);
+	unindex_dive_text(dive);
+	unindex_dive_sac(dive);
+}
@@ -4,9 +4,11 @@
 #include <time.h>
 
 #include "dive.h"
+#include "deco.h"
 #include "display.h"
 
 static GtkWidget *divedate, *divetime, *depth, *duration, *temperature, *locationnote;
+static GtkWidget *surfacetime, *oxygen, *consumption;
 static GtkTextBuffer *location, *notes;
 static int location_changed = 1, notes_changed = 1;
 static struct dive *buffered_dive;
@@ -29,22 +31,52 @@ static char *get_text(GtkTextBuffer *buffer)
 	return gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
 }
 
+/* NULL and "" are the same thing for dive text */
+static int text_changed(const char *old, const char *new)
+{
+	return strcmp(old ? : "", new ? : "");
+}
+
 void flush_dive_info_changes(void)
 {
 	struct dive *dive = buffered_dive;
+	char *new_location = NULL, *new_notes = NULL;
+	int changed = 0;
 
 	if (!dive)
 		return;
 
 	if (location_changed) {
-		g_free(dive->location);
-		dive->location = get_text(location);
+		new_location = get_text(location);
+		changed |= text_changed(dive->location, new_location);
 	}
 
 	if (notes_changed) {
+		new_notes = get_text(notes);
+		changed |= text_changed(dive->notes, new_notes);
+	}
+
+	if (!changed) {
+		g_free(new_location);
+		g_free(new_notes);
+		return;
+	}
+
+	/* The location and notes are indexed, so re-index around the edit */
+	lock_dive_table();
+	unindex_dive(dive);
+	if (new_location) {
+		g_free(dive->location);
+		dive->location = new_location;
+	}
+	if (new_notes) {
 		g_free(dive->notes);
-		dive->notes = get_text(notes);
+		dive->notes = new_notes;
 	}
+	dive->dirty = 1;
+	index_dive(dive);
+	journal_edit(dive);
+	unlock_dive_table();
 }
 
 void update_dive_info(struct dive *dive)
@@ -52,6 +84,8 @@ void update_dive_info(struct dive *dive)
 	struct tm *tm;
 	char buffer[80];
 	char *text;
+	double cns, otu;
+	struct sac_info sac;
 
 	flush_dive_info_changes();
 	buffered_dive = dive;
@@ -61,6 +95,9 @@ void update_dive_info(struct dive *dive)
 		gtk_label_set_text(GTK_LABEL(divetime), "");
 		gtk_label_set_text(GTK_LABEL(depth), "");
 		gtk_label_set_text(GTK_LABEL(duration), "");
+		gtk_label_set_text(GTK_LABEL(surfacetime), "");
+		gtk_label_set_text(GTK_LABEL(oxygen), "");
+		gtk_label_set_text(GTK_LABEL(consumption), "");
 		return;
 	}
 
@@ -93,6 +130,29 @@ void update_dive_info(struct dive *dive)
 			to_C(dive->watertemp));
 	gtk_label_set_text(GTK_LABEL(temperature), buffer);
 
+	/* This also gets the surface interval filled in */
+	*buffer = 0;
+	if (!chain_exposure(dive, &cns, &otu))
+		snprintf(buffer, sizeof(buffer),
+			"CNS %.0f%%  OTU %.0f",
+			cns, otu);
+	gtk_label_set_text(GTK_LABEL(oxygen), buffer);
+
+	*buffer = 0;
+	if (dive->surfacetime.seconds)
+		snprintf(buffer, sizeof(buffer),
+			"SI %d:%02d",
+			dive->surfacetime.seconds / 3600,
+			dive->surfacetime.seconds / 60 % 60);
+	gtk_label_set_text(GTK_LABEL(surfacetime), buffer);
+
+	*buffer = 0;
+	if (!dive_sac(dive, &sac, NULL))
+		snprintf(buffer, sizeof(buffer),
+			"SAC %.1f l/min",
+			sac_rate(sac.gas, sac.exposure) / 1000.0);
+	gtk_label_set_text(GTK_LABEL(consumption), buffer);
+
 	text = dive->location ? : "";
 	gtk_text_buffer_set_text(location, text, -1);
 	gtk_label_set_text(GTK_LABEL(locationnote), text);
@@ -135,6 +195,9 @@ GtkWidget *dive_info_frame(void)
 	depth = info_label(hbox, "depth", GTK_JUSTIFY_RIGHT);
 	duration = info_label(hbox, "duration", GTK_JUSTIFY_RIGHT);
 	temperature = info_label(hbox, "temperature", GTK_JUSTIFY_RIGHT);
+	surfacetime = info_label(hbox, "surface interval", GTK_JUSTIFY_RIGHT);
+	oxygen = info_label(hbox, "oxygen", GTK_JUSTIFY_RIGHT);
+	consumption = info_label(hbox, "consumption", GTK_JUSTIFY_RIGHT);
 
 	locationnote = info_label(hbox2, "location", GTK_JUSTIFY_LEFT);
 	gtk_label_set_width_chars(GTK_LABEL(locationnote), 80);
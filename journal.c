@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dive.h"
+#include "membuffer.h"
+
+/*
+ * The change journal.
+ *
+ * Rather than rewriting the whole dive log every time somebody
+ * edits a note, we append a small record for every committed edit,
+ * merge and import to "<logfile>.journal", and fdatasync() it. On
+ * startup, the journal gets replayed on top of the log file. Every
+ * so often a background thread writes a full save of the log file
+ * and drops the journal records that the full save now contains.
+ *
+ * The records are text, with the free-form parts length-prefixed
+ * so that they don't need any quoting:
+ *
+ *	E <when> location <len>\n<text>\n
+ *	E <when> notes <len>\n<text>\n
+ *	M <when>\n
+ *	I <len>\n<filename>\n
+ *
+ * Dives are identified by their start time, which is what the
+ * dive table is sorted by. All records are idempotent, so replaying
+ * a journal that was already (partially) folded into the log file
+ * does no harm.
+ *
+ * Journal writes happen with the dive table locked, so the journal
+ * always matches the dive table that a compaction sees.
+ */
+static char *log_name, *journal_name;
+static int journal_fd = -1;
+static off_t journal_size;
+static int compacting;
+
+/* Full saves to the log file, which make a compaction out of date */
+static unsigned int log_saves;
+
+static void append_record(struct membuffer *b)
+{
+	unsigned int len = b->len;
+
+	if (journal_fd < 0) {
+		b->len = 0;
+		return;
+	}
+	if (write_buffer(b, journal_fd) < 0 || fdatasync(journal_fd) < 0) {
+		fprintf(stderr, "Failed to write journal '%s': %s\n", journal_name, strerror(errno));
+		b->len = 0;
+		return;
+	}
+	journal_size += len;
+}
+
+static void put_text_record(struct membuffer *b, struct dive *dive, const char *field, const char *text)
+{
+	unsigned int len;
+
+	text = text ? : "";
+	len = strlen(text);
+	put_format(b, "E %lld %s %u\n", (long long) dive->when, field, len);
+	put_bytes(b, text, len);
+	put_char(b, '\n');
+}
+
+/* An edit of the location or notes of a dive */
+void journal_edit(struct dive *dive)
+{
+	struct membuffer b = { 0 };
+
+	put_text_record(&b, dive, "location", dive->location);
+	put_text_record(&b, dive, "notes", dive->notes);
+	append_record(&b);
+	free_buffer(&b);
+}
+
+void journal_merge(struct dive *dive)
+{
+	struct membuffer b = { 0 };
+
+	put_format(&b, "M %lld\n", (long long) dive->when);
+	append_record(&b);
+	free_buffer(&b);
+}
+
+void journal_import(const char *filename)
+{
+	struct membuffer b = { 0 };
+	char path[PATH_MAX];
+
+	if (journal_fd < 0)
+		return;
+	if (!realpath(filename, path))
+		return;
+	put_format(&b, "I %u\n%s\n", (unsigned) strlen(path), path);
+	append_record(&b);
+	free_buffer(&b);
+}
+
+static struct dive *find_dive(time_t when)
+{
+	int idx = dive_index_after(when);
+
+	if (idx >= dive_table.nr || dive_table.when[idx] != when)
+		return NULL;
+	return dive_table.dives[idx];
+}
+
+static void replay_edit(time_t when, const char *field, const char *text, unsigned int len)
+{
+	struct dive *dive = find_dive(when);
+	char **p, *new;
+
+	if (!dive)
+		return;
+	if (!strcmp(field, "location"))
+		p = &dive->location;
+	else if (!strcmp(field, "notes"))
+		p = &dive->notes;
+	else
+		return;
+
+	new = strndup(text, len);
+	if (!new)
+		return;
+	unindex_dive(dive);
+	free(*p);
+	*p = new;
+	dive->dirty = 1;
+	index_dive(dive);
+}
+
+static void replay_merge(time_t when)
+{
+	int first;
+
+	/* Still two dives there? Then the import hasn't merged them yet */
+	if (dives_between(when, when + 1, &first) > 1)
+		merge_dive_table();
+}
+
+static void replay_import(const char *name, unsigned int len)
+{
+	char *filename = strndup(name, len);
+
+	if (!filename)
+		return;
+	parse_xml_file(filename);
+	merge_dive_table();
+	free(filename);
+}
+
+/*
+ * Replay the records in 'buf'. Returns how much of it was good:
+ * if we crashed in the middle of appending a record, the tail
+ * is garbage, and we'll cut it off.
+ */
+static unsigned int replay_journal(const char *buf, unsigned int size)
+{
+	const char *p = buf, *end = buf + size;
+
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		const char *payload;
+		char field[16];
+		long long when;
+		unsigned int len;
+
+		if (!nl)
+			break;
+		payload = nl + 1;
+		switch (*p) {
+		case 'E':
+			if (sscanf(p, "E %lld %15s %u", &when, field, &len) != 3)
+				goto bad;
+			if (len >= end - payload || payload[len] != '\n')
+				goto bad;
+			replay_edit(when, field, payload, len);
+			nl = payload + len;
+			break;
+		case 'M':
+			if (sscanf(p, "M %lld", &when) != 1)
+				goto bad;
+			replay_merge(when);
+			break;
+		case 'I':
+			if (sscanf(p, "I %u", &len) != 1)
+				goto bad;
+			if (len >= end - payload || payload[len] != '\n')
+				goto bad;
+			replay_import(payload, len);
+			nl = payload + len;
+			break;
+		default:
+			goto bad;
+		}
+		p = nl + 1;
+	}
+bad:
+	return p - buf;
+}
+
+/*
+ * Replay the journal of 'logfile' (which has already been loaded),
+ * and start journaling all changes to it.
+ */
+void open_journal(const char *logfile)
+{
+	struct membuffer name = { 0 };
+	struct stat st;
+	char *buf;
+	unsigned int good;
+	int fd;
+
+	put_format(&name, "%s.journal", logfile);
+	put_char(&name, 0);
+	free(journal_name);
+	free(log_name);
+	journal_name = name.buffer;
+	log_name = strdup(logfile);
+
+	if (journal_fd >= 0)
+		close(journal_fd);
+	fd = open(journal_name, O_RDWR | O_CREAT | O_APPEND, 0666);
+	journal_fd = -1;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Can't open journal '%s': %s\n", journal_name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	good = 0;
+	buf = malloc(st.st_size + 1);
+	if (buf) {
+		int len = read(fd, buf, st.st_size);
+		if (len > 0) {
+			lock_dive_table();
+			good = replay_journal(buf, len);
+			unlock_dive_table();
+		}
+		free(buf);
+	}
+	if (good < st.st_size) {
+		fprintf(stderr, "Dropping %lld bytes of bad journal '%s'\n",
+			(long long) st.st_size - good, journal_name);
+		if (ftruncate(fd, good) < 0)
+			fprintf(stderr, "Can't truncate '%s': %s\n", journal_name, strerror(errno));
+	}
+	journal_fd = fd;
+	journal_size = good;
+}
+
+/*
+ * Drop the first 'done' bytes of the journal, which are now in
+ * the log file. Called with the dive table locked.
+ */
+static void drop_journal_head(off_t done)
+{
+	struct membuffer tail = { 0 };
+	struct membuffer tmp = { 0 };
+	off_t left = journal_size - done;
+	int fd;
+
+	/* Somebody did a full save to the log file meanwhile? */
+	if (done > journal_size)
+		return;
+
+	if (!left) {
+		if (ftruncate(journal_fd, 0) == 0)
+			journal_size = 0;
+		return;
+	}
+
+	/* Edits that came in while we were saving: keep them */
+	make_room(&tail, left);
+	if (pread(journal_fd, tail.buffer, left, done) != left)
+		goto out;
+	tail.len = left;
+
+	put_format(&tmp, "%s.tmp", journal_name);
+	put_char(&tmp, 0);
+	fd = open(tmp.buffer, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+	if (fd < 0)
+		goto out;
+	if (write_buffer(&tail, fd) < 0 || fsync(fd) < 0 || rename(tmp.buffer, journal_name) < 0) {
+		close(fd);
+		unlink(tmp.buffer);
+		goto out;
+	}
+	close(journal_fd);
+	journal_fd = fd;
+	journal_size = left;
+out:
+	free_buffer(&tail);
+	free_buffer(&tmp);
+}
+
+/*
+ * The whole log was saved to 'filename'. If that's our log file,
+ * the journal has nothing left that isn't in it.
+ */
+void journal_saved(const char *filename)
+{
+	struct stat a, b;
+
+	if (journal_fd < 0 || stat(filename, &a) || stat(log_name, &b))
+		return;
+	if (a.st_dev != b.st_dev || a.st_ino != b.st_ino)
+		return;
+	lock_dive_table();
+	log_saves++;
+	if (ftruncate(journal_fd, 0) == 0)
+		journal_size = 0;
+	unlock_dive_table();
+}
+
+/*
+ * The compaction formats the whole log in memory with the dive table
+ * locked, which is quick, and does the slow part of writing it out
+ * without the lock, so the GUI doesn't stop while we're at it. Edits
+ * that come in meanwhile go to the end of the journal, and stay there
+ * when we drop the part that the new log file has.
+ *
+ * The file gets written next to the log file and renamed over it, so
+ * that a crash leaves either the old log and the full journal, or the
+ * new log. If somebody did a full save to the log file while we were
+ * writing, that's newer than ours, and we just throw ours away.
+ *
+ * A dive directory only writes the dives that changed, each renamed
+ * into place, so that one still gets saved with the lock held.
+ */
+static void *compact_worker(void *unused)
+{
+	struct membuffer buf = { 0 }, tmp = { 0 };
+	struct stat st;
+	unsigned int saves;
+	off_t done;
+	int ret;
+
+	lock_dive_table();
+	done = journal_size;
+	saves = log_saves;
+	if (!stat(log_name, &st) && S_ISDIR(st.st_mode)) {
+		if (!write_dives(log_name))
+			drop_journal_head(done);
+		goto out;
+	}
+	ret = format_dives(log_name, &buf);
+	unlock_dive_table();
+
+	put_format(&tmp, "%s.tmp", log_name);
+	put_char(&tmp, 0);
+	if (!ret)
+		ret = write_formatted_dives(tmp.buffer, log_name, &buf);
+
+	lock_dive_table();
+	if (ret < 0 || saves != log_saves || rename(tmp.buffer, log_name) < 0)
+		unlink(tmp.buffer);
+	else
+		drop_journal_head(done);
+out:
+	compacting = 0;
+	unlock_dive_table();
+	free_buffer(&buf);
+	free_buffer(&tmp);
+	return NULL;
+}
+
+/*
+ * Fold the journal into a full save of the log file, in the
+ * background. Does nothing if there's nothing in the journal, or
+ * if a compaction is already running.
+ */
+void compact_journal(void)
+{
+	pthread_t thread;
+	int start;
+
+	lock_dive_table();
+	start = journal_fd >= 0 && journal_size && !compacting;
+	if (start)
+		compacting = 1;
+	unlock_dive_table();
+	if (!start)
+		return;
+
+	if (pthread_create(&thread, NULL, compact_worker, NULL)) {
+		lock_dive_table();
+		compacting = 0;
+		unlock_dive_table();
+		return;
+	}
+	pthread_detach(thread);
+}
@@ -2,67 +2,101 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
 
 #include "dive.h"
+#include "deco.h"
 #include "display.h"
 
 GtkWidget *main_window;
 
-static int sortfn(const void *_a, const void *_b)
-{
-	const struct dive *a = *(void **)_a;
-	const struct dive *b = *(void **)_b;
-
-	if (a->when < b->when)
-		return -1;
-	if (a->when > b->when)
-		return 1;
-	return 0;
-}
-
 /*
  * This doesn't really report anything at all. We just sort the
  * dives, the GUI does the reporting
  */
 static void report_dives(void)
 {
-	int i;
-
-	qsort(dive_table.dives, dive_table.nr, sizeof(struct dive *), sortfn);
-
-	for (i = 1; i < dive_table.nr; i++) {
-		struct dive **pp = &dive_table.dives[i-1];
-		struct dive *prev = pp[0];
-		struct dive *dive = pp[1];
-		struct dive *merged;
+	sort_dive_table();
+	merge_dive_table();
+}
 
-		if (prev->when + prev->duration.seconds < dive->when)
-			continue;
+/* --export=<dir> or --export-csv=<dir>: export the dives and exit */
+static const char *export_dir;
+static int export_csv;
 
-		merged = try_to_merge(prev, dive);
-		if (!merged)
-			continue;
+/* --save=<file>: save all the dives to one log file, and exit */
+static const char *save_file;
 
-		free(prev);
-		free(dive);
-		*pp = merged;
-		dive_table.nr--;
-		memmove(pp+1, pp+2, sizeof(*pp)*(dive_table.nr - i));
+/* --render=<dir>: profile images of all the dives, and exit */
+static const char *render_dir;
+static const char *render_format = "png";
+static int render_width = 450, render_height = 350;
 
-		/* Redo the new 'i'th dive */
-		i--;
+static void parse_long_argument(const char *arg)
+{
+	if (!strncmp(arg, "--export=", 9)) {
+		export_dir = arg + 9;
+		return;
+	}
+	if (!strncmp(arg, "--export-csv=", 13)) {
+		export_dir = arg + 13;
+		export_csv = 1;
+		return;
+	}
+	if (!strncmp(arg, "--save=", 7)) {
+		save_file = arg + 7;
+		return;
+	}
+	if (!strncmp(arg, "--render=", 9)) {
+		render_dir = arg + 9;
+		return;
+	}
+	if (!strncmp(arg, "--render-format=", 16)) {
+		render_format = arg + 16;
+		return;
 	}
+	if (!strncmp(arg, "--render-size=", 14)) {
+		if (sscanf(arg + 14, "%dx%d", &render_width, &render_height) == 2)
+			return;
+	}
+	/* --gf=30/85: the gradient factors for the deco ceiling */
+	if (!strncmp(arg, "--gf=", 5)) {
+		if (sscanf(arg + 5, "%d/%d", &gf_low, &gf_high) == 2 &&
+		    gf_low > 0 && gf_low <= gf_high && gf_high <= 100)
+			return;
+	}
+	/* --rates=10/30: the ascent and descent rate limits, in m/min */
+	if (!strncmp(arg, "--rates=", 8)) {
+		int up, down;
+
+		if (sscanf(arg + 8, "%d/%d", &up, &down) == 2 && up > 0 && down > 0) {
+			ascent_limit = up * 1000;
+			descent_limit = down * 1000;
+			return;
+		}
+	}
+	fprintf(stderr, "Bad argument '%s'\n", arg);
+	exit(1);
 }
 
 static void parse_argument(const char *arg)
 {
 	const char *p = arg+1;
 
+	if (*p == '-') {
+		parse_long_argument(arg);
+		return;
+	}
+
 	do {
 		switch (*p) {
 		case 'v':
 			verbose++;
 			continue;
+		case 'j':
+			/* -j<n>: save and render with <n> threads */
+			save_threads = atoi(p+1);
+			return;
 		default:
 			fprintf(stderr, "Bad argument '%s'\n", arg);
 			exit(1);
@@ -70,6 +104,29 @@ static void parse_argument(const char *arg)
 	} while (*++p);
 }
 
+/*
+ * Exporting, saving and rendering don't need a display, so we don't even
+ * initialize GTK for them. That has to be decided before gtk_init()
+ * gets to see (and eat) the GTK arguments.
+ */
+static const char *batch_options[] = {
+	"--export=", "--export-csv=", "--save=", "--render=", NULL
+};
+
+static int batch_mode(int argc, char **argv)
+{
+	const char **opt;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		for (opt = batch_options; *opt; opt++) {
+			if (!strncmp(argv[i], *opt, strlen(*opt)))
+				return 1;
+		}
+	}
+	return 0;
+}
+
 static void on_destroy(GtkWidget* w, gpointer data)
 {
 	gtk_main_quit();
@@ -85,6 +142,33 @@ void repaint_dive(void)
 
 static char *existing_filename;
 
+/* How often we fold the journal back into the log file */
+#define COMPACT_INTERVAL 60
+
+static gboolean compact_timeout(gpointer data)
+{
+	compact_journal();
+	return TRUE;
+}
+
+/*
+ * Importing merges dives, which can free the one that the info
+ * frame is showing, so get any edits out of there first.
+ */
+static void import_file(const char *filename)
+{
+	update_dive_info(NULL);
+	journal_import(filename);
+
+	lock_dive_table();
+	parse_xml_file(filename);
+	report_dives();
+	unlock_dive_table();
+
+	update_dive_list();
+	repaint_dive();
+}
+
 static void file_open(GtkWidget *w, gpointer data)
 {
 	GtkWidget *dialog;
@@ -98,12 +182,24 @@ static void file_open(GtkWidget *w, gpointer data)
 	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
 		char *filename;
 		filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-		printf("Open: '%s'\n", filename);
+		import_file(filename);
 		g_free(filename);
 	}
 	gtk_widget_destroy(dialog);
 }
 
+static void save_error(const char *filename)
+{
+	GtkWidget *dialog;
+
+	dialog = gtk_message_dialog_new(GTK_WINDOW(main_window),
+		GTK_DIALOG_DESTROY_WITH_PARENT,
+		GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+		"Failed to save '%s': %s", filename, strerror(errno));
+	gtk_dialog_run(GTK_DIALOG(dialog));
+	gtk_widget_destroy(dialog);
+}
+
 static void file_save(GtkWidget *w, gpointer data)
 {
 	GtkWidget *dialog;
@@ -122,7 +218,8 @@ static void file_save(GtkWidget *w, gpointer data)
 	if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
 		char *filename;
 		filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-		save_dives(filename);
+		if (save_dives(filename) < 0)
+			save_error(filename);
 		g_free(filename);
 	}
 	gtk_widget_destroy(dialog);
@@ -151,7 +248,8 @@ static GtkWidget *get_menubar_menu(GtkWidget *window)
 
 int main(int argc, char **argv)
 {
-	int i;
+	int i, files = 0, batch;
+	const char *filename = NULL;
 	GtkWidget *win;
 	GtkWidget *divelist;
 	GtkWidget *table;
@@ -162,7 +260,13 @@ int main(int argc, char **argv)
 
 	parse_xml_init();
 
-	gtk_init(&argc, &argv);
+	batch = batch_mode(argc, argv);
+	if (!batch) {
+		/* The dive list thumbnails get drawn in a thread */
+		if (!g_thread_supported())
+			g_thread_init(NULL);
+		gtk_init(&argc, &argv);
+	}
 
 	for (i = 1; i < argc; i++) {
 		const char *a = argv[i];
@@ -172,10 +276,34 @@ int main(int argc, char **argv)
 			continue;
 		}
 		parse_xml_file(a);
+		filename = a;
+		files++;
 	}
 
 	report_dives();
 
+	if (batch) {
+		int err = 0;
+
+		if (export_dir && export_dives(export_dir, export_csv) < 0)
+			err = 1;
+		if (save_file && write_dives(save_file) < 0)
+			err = 1;
+		if (render_dir && render_dives(render_dir, render_format, render_width, render_height) < 0)
+			err = 1;
+		return err;
+	}
+
+	/*
+	 * With just one log file, that's the one we're editing: keep
+	 * a journal of the changes to it.
+	 */
+	if (files == 1) {
+		existing_filename = strdup(filename);
+		open_journal(filename);
+		g_timeout_add_seconds(COMPACT_INTERVAL, compact_timeout, NULL);
+	}
+
 	win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	g_signal_connect(G_OBJECT(win), "destroy",      G_CALLBACK(on_destroy), NULL);
 	main_window = win;
@@ -211,6 +339,14 @@ int main(int argc, char **argv)
 	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), frame, gtk_label_new("Dive Profile"));
 	dive_profile = frame;
 
+	/* Frame for comparing dives */
+	frame = dive_overlay_frame();
+	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), frame, gtk_label_new("Compare"));
+
+	/* Frame for the statistics */
+	frame = dive_stats_frame();
+	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), frame, gtk_label_new("Statistics"));
+
 	/* Frame for extended dive info */
 	frame = extended_dive_info_frame();
 	gtk_notebook_append_page(GTK_NOTEBOOK(notebook), frame, gtk_label_new("Extended dive Info"));
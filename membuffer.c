@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "membuffer.h"
+
+void free_buffer(struct membuffer *b)
+{
+	free(b->buffer);
+	b->buffer = NULL;
+	b->len = 0;
+	b->alloc = 0;
+}
+
+void make_room(struct membuffer *b, unsigned int size)
+{
+	unsigned int needed = b->len + size;
+
+	if (needed > b->alloc) {
+		char *n;
+
+		/* round it up to not reallocate all the time.. */
+		needed = needed * 9 / 8 + 1024;
+		n = realloc(b->buffer, needed);
+		if (!n)
+			exit(1);
+		b->buffer = n;
+		b->alloc = needed;
+	}
+}
+
+void put_bytes(struct membuffer *b, const char *str, int len)
+{
+	make_room(b, len);
+	memcpy(b->buffer + b->len, str, len);
+	b->len += len;
+}
+
+void put_string(struct membuffer *b, const char *str)
+{
+	put_bytes(b, str, strlen(str));
+}
+
+/* Decimal digits, written backwards from 'end' */
+static char *format_digits(char *end, unsigned int n, int min)
+{
+	do {
+		*--end = '0' + n % 10;
+		n /= 10;
+		min--;
+	} while (n || min > 0);
+	return end;
+}
+
+void put_uint(struct membuffer *b, unsigned int n)
+{
+	char buf[16], *end = buf + sizeof(buf);
+	char *p = format_digits(end, n, 1);
+
+	put_bytes(b, p, end - p);
+}
+
+/*
+ * Fixed-point output: "n/div", a separator, and "n%div" zero-padded
+ * to 'digits' digits. So our millibar become "%u.%03u" bar, and
+ * seconds become "%u:%02u" minutes.
+ */
+void put_fraction(struct membuffer *b, unsigned int n, unsigned int div, char sep, int digits)
+{
+	char buf[32], *end = buf + sizeof(buf);
+	char *p = format_digits(end, n % div, digits);
+
+	*--p = sep;
+	p = format_digits(p, n / div, 1);
+	put_bytes(b, p, end - p);
+}
+
+/* For the odd things that aren't worth doing by hand */
+void put_format(struct membuffer *b, const char *fmt, ...)
+{
+	va_list args;
+	int room = 128;
+
+	for (;;) {
+		int len;
+
+		make_room(b, room);
+		room = b->alloc - b->len;
+		va_start(args, fmt);
+		len = vsnprintf(b->buffer + b->len, room, fmt, args);
+		va_end(args);
+		if (len < room) {
+			b->len += len;
+			return;
+		}
+		room = len + 1;
+	}
+}
+
+/*
+ * Write out the whole buffer and empty it. Returns 0 or -1, with
+ * errno set by the failing write.
+ */
+int write_buffer(struct membuffer *b, int fd)
+{
+	const char *p = b->buffer;
+	unsigned int left = b->len;
+
+	while (left) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+	b->len = 0;
+	return 0;
+}
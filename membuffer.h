@@ -0,0 +1,31 @@
+#ifndef MEMBUFFER_H
+#define MEMBUFFER_H
+
+/*
+ * A growable in-memory output buffer, so that we can build up
+ * the output with simple memory copies and write it out in big
+ * blocks, rather than going through stdio and printf for every
+ * little piece.
+ */
+struct membuffer {
+	unsigned int len, alloc;
+	char *buffer;
+};
+
+extern void free_buffer(struct membuffer *b);
+extern void make_room(struct membuffer *b, unsigned int size);
+extern void put_bytes(struct membuffer *b, const char *str, int len);
+extern void put_string(struct membuffer *b, const char *str);
+extern void put_uint(struct membuffer *b, unsigned int n);
+extern void put_fraction(struct membuffer *b, unsigned int n, unsigned int div, char sep, int digits);
+extern void put_format(struct membuffer *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+extern int write_buffer(struct membuffer *b, int fd);
+
+static inline void put_char(struct membuffer *b, char c)
+{
+	if (b->len >= b->alloc)
+		make_room(b, 1);
+	b->buffer[b->len++] = c;
+}
+
+#endif
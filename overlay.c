@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+#include "display.h"
+#include "plot.h"
+
+/*
+ * Comparing dives: the depth profiles of a number of them drawn on
+ * top of each other, on common axes, each one shifted by its own
+ * offset in seconds. Think of the duplicates of a dive that didn't
+ * merge, or the computers of a couple of buddies.
+ *
+ * The overlay gets drawn into an offscreen surface a dive at a time,
+ * so adding a dive just draws that one on top of the others. Only
+ * when the axes have to grow for it, or a dive gets moved or taken
+ * out, does it all get redrawn. Each dive has its own plot info, with
+ * just the depth, decimated for the pixel columns it takes up, so even
+ * that doesn't depend on how long the dives are.
+ */
+#define MAX_OVERLAY 16
+
+static const struct overlay_color {
+	double r, g, b;
+	const char *name;
+} overlay_color[] = {
+	{ 1.0, 0.2, 0.2, "#ff3333" },
+	{ 0.2, 1.0, 0.2, "#33ff33" },
+	{ 0.3, 0.6, 1.0, "#4d99ff" },
+	{ 1.0, 0.8, 0.0, "#ffcc00" },
+	{ 1.0, 0.4, 1.0, "#ff66ff" },
+	{ 0.0, 1.0, 1.0, "#00ffff" },
+	{ 1.0, 0.6, 0.2, "#ff9933" },
+	{ 1.0, 1.0, 1.0, "#ffffff" },
+};
+#define NR_COLORS (sizeof(overlay_color) / sizeof(overlay_color[0]))
+
+static struct overlay_dive {
+	struct dive *dive;
+	int offset;
+	const struct overlay_color *color;
+	struct plot_info pi;
+} overlay[MAX_OVERLAY];
+
+static int nr_overlay;
+
+/* What's in the offscreen surface */
+static struct overlay_state {
+	unsigned int generation;
+	int w, h, drawn;
+	struct plot_axes axes;
+	cairo_surface_t *surface;
+} state;
+
+static GtkWidget *overlay_area;
+static GtkListStore *overlay_store;
+static GtkWidget *overlay_list;
+
+enum { NAME_COLUMN, OFFSET_COLUMN, COLOR_COLUMN };
+
+static void set_overlay_row(GtkTreeIter *iter, struct overlay_dive *o)
+{
+	char offset[16];
+
+	snprintf(offset, sizeof(offset), "%d", o->offset);
+	gtk_list_store_set(overlay_store, iter,
+		NAME_COLUMN, o->dive->name,
+		OFFSET_COLUMN, offset,
+		COLOR_COLUMN, o->color->name,
+		-1);
+}
+
+static void fill_overlay_list(void)
+{
+	GtkTreeIter iter;
+	int i;
+
+	gtk_list_store_clear(overlay_store);
+	for (i = 0; i < nr_overlay; i++) {
+		gtk_list_store_append(overlay_store, &iter);
+		set_overlay_row(&iter, overlay + i);
+	}
+}
+
+/* Everything has to be drawn again */
+static void redraw_overlay(void)
+{
+	state.drawn = 0;
+	gtk_widget_queue_draw(overlay_area);
+}
+
+static void remove_overlay_dive(int idx)
+{
+	free_plot_info(&overlay[idx].pi);
+	memmove(overlay + idx, overlay + idx + 1, (nr_overlay - idx - 1) * sizeof(*overlay));
+	memset(overlay + --nr_overlay, 0, sizeof(*overlay));
+}
+
+static int dive_in_table(struct dive *dive)
+{
+	int i;
+
+	for (i = 0; i < dive_table.nr; i++) {
+		if (dive_table.dives[i] == dive)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * The dive table changed: a merge may have freed some of our dives,
+ * and the ones that are left need their plot info rebuilt.
+ */
+static void check_overlay_dives(void)
+{
+	int i;
+
+	if (state.generation == dive_table.generation)
+		return;
+	state.generation = dive_table.generation;
+	for (i = nr_overlay - 1; i >= 0; i--) {
+		if (!dive_in_table(overlay[i].dive))
+			remove_overlay_dive(i);
+		else
+			build_depth_plot_info(&overlay[i].pi, overlay[i].dive);
+	}
+	fill_overlay_list();
+	state.drawn = 0;
+}
+
+static gboolean overlay_expose_event(GtkWidget *widget, GdkEventExpose *event, gpointer data)
+{
+	int w = widget->allocation.width;
+	int h = widget->allocation.height;
+	struct plot_axes axes;
+	cairo_t *cr;
+	int i;
+
+	check_overlay_dives();
+
+	plot_axes_init(&axes);
+	for (i = 0; i < nr_overlay; i++)
+		plot_axes_add(&axes, &overlay[i].pi, overlay[i].offset);
+
+	/* A different size or different axes: start over */
+	if (!state.surface || state.w != w || state.h != h ||
+	    memcmp(&axes, &state.axes, sizeof(axes)))
+		state.drawn = 0;
+
+	if (!state.drawn) {
+		if (state.surface && (state.w != w || state.h != h)) {
+			cairo_surface_destroy(state.surface);
+			state.surface = NULL;
+		}
+		if (!state.surface)
+			state.surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+		state.w = w;
+		state.h = h;
+		state.axes = axes;
+
+		cr = cairo_create(state.surface);
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		cairo_paint(cr);
+		plot_axes(cr, w, h, &axes);
+		cairo_destroy(cr);
+	}
+
+	/* Just the dives that aren't in there yet */
+	if (state.drawn < nr_overlay) {
+		cr = cairo_create(state.surface);
+		for (i = state.drawn; i < nr_overlay; i++) {
+			struct overlay_dive *o = overlay + i;
+			plot_overlay(cr, w, h, &state.axes, &o->pi, o->offset,
+				o->color->r, o->color->g, o->color->b);
+		}
+		cairo_destroy(cr);
+		state.drawn = nr_overlay;
+	}
+
+	cr = gdk_cairo_create(widget->window);
+	gdk_cairo_region(cr, event->region);
+	cairo_clip(cr);
+	cairo_set_source_surface(cr, state.surface, 0, 0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	return FALSE;
+}
+
+/* The first color nobody has yet, or just the next one */
+static const struct overlay_color *free_color(void)
+{
+	int i, j;
+
+	for (i = 0; i < NR_COLORS; i++) {
+		for (j = 0; j < nr_overlay; j++) {
+			if (overlay[j].color == overlay_color + i)
+				break;
+		}
+		if (j == nr_overlay)
+			return overlay_color + i;
+	}
+	return overlay_color + nr_overlay % NR_COLORS;
+}
+
+static void add_clicked(GtkWidget *button, gpointer data)
+{
+	struct dive *dive = current_dive;
+	struct overlay_dive *o;
+	GtkTreeIter iter;
+	int i;
+
+	if (!dive || nr_overlay == MAX_OVERLAY)
+		return;
+	check_overlay_dives();
+	for (i = 0; i < nr_overlay; i++) {
+		if (overlay[i].dive == dive)
+			return;
+	}
+
+	o = overlay + nr_overlay;
+	o->dive = dive;
+	o->offset = 0;
+	o->color = free_color();
+	nr_overlay++;
+	build_depth_plot_info(&o->pi, dive);
+
+	gtk_list_store_append(overlay_store, &iter);
+	set_overlay_row(&iter, o);
+	gtk_widget_queue_draw(overlay_area);
+}
+
+static void remove_clicked(GtkWidget *button, gpointer data)
+{
+	GtkTreeSelection *selection;
+	GtkTreeModel *model;
+	GtkTreeIter iter;
+	GtkTreePath *path;
+	int idx;
+
+	selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(overlay_list));
+	if (!gtk_tree_selection_get_selected(selection, &model, &iter))
+		return;
+	path = gtk_tree_model_get_path(model, &iter);
+	idx = gtk_tree_path_get_indices(path)[0];
+	gtk_tree_path_free(path);
+
+	remove_overlay_dive(idx);
+	gtk_list_store_remove(overlay_store, &iter);
+	redraw_overlay();
+}
+
+static void clear_clicked(GtkWidget *button, gpointer data)
+{
+	while (nr_overlay)
+		remove_overlay_dive(nr_overlay - 1);
+	gtk_list_store_clear(overlay_store);
+	redraw_overlay();
+}
+
+static void offset_edited(GtkCellRendererText *cell, gchar *path, gchar *text, gpointer data)
+{
+	int idx = atoi(path);
+	GtkTreeIter iter;
+	char *end;
+	long offset;
+
+	offset = strtol(text, &end, 10);
+	if (idx >= nr_overlay || end == text || *end)
+		return;
+	overlay[idx].offset = offset;
+	if (gtk_tree_model_get_iter_from_string(GTK_TREE_MODEL(overlay_store), &iter, path))
+		set_overlay_row(&iter, overlay + idx);
+	redraw_overlay();
+}
+
+static GtkWidget *create_overlay_list(void)
+{
+	GtkWidget *tree_view, *scroll_window;
+	GtkCellRenderer *renderer;
+	GtkTreeViewColumn *col;
+
+	overlay_store = gtk_list_store_new(3, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+	tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(overlay_store));
+	overlay_list = tree_view;
+
+	/* The dive name in the color of its line */
+	renderer = gtk_cell_renderer_text_new();
+	col = gtk_tree_view_column_new_with_attributes("Dive", renderer,
+		"text", NAME_COLUMN, "foreground", COLOR_COLUMN, NULL);
+	gtk_tree_view_column_set_expand(col, TRUE);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
+
+	renderer = gtk_cell_renderer_text_new();
+	g_object_set(G_OBJECT(renderer), "editable", TRUE, NULL);
+	g_signal_connect(renderer, "edited", G_CALLBACK(offset_edited), NULL);
+	col = gtk_tree_view_column_new_with_attributes("Offset (s)", renderer,
+		"text", OFFSET_COLUMN, NULL);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
+
+	scroll_window = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll_window),
+		GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+	gtk_widget_set_size_request(scroll_window, -1, 100);
+	gtk_container_add(GTK_CONTAINER(scroll_window), tree_view);
+	return scroll_window;
+}
+
+static GtkWidget *overlay_button(const char *label, GCallback clicked)
+{
+	GtkWidget *button = gtk_button_new_with_label(label);
+
+	g_signal_connect(button, "clicked", clicked, NULL);
+	return button;
+}
+
+GtkWidget *dive_overlay_frame(void)
+{
+	GtkWidget *frame;
+	GtkWidget *vbox, *hbox, *buttons;
+	GtkWidget *da;
+
+	frame = gtk_frame_new("Compare dives");
+	gtk_widget_show(frame);
+	vbox = gtk_vbox_new(FALSE, 5);
+	gtk_container_add(GTK_CONTAINER(frame), vbox);
+
+	da = gtk_drawing_area_new();
+	gtk_widget_set_size_request(da, 450, 250);
+	g_signal_connect(da, "expose_event", G_CALLBACK(overlay_expose_event), NULL);
+	gtk_box_pack_start(GTK_BOX(vbox), da, TRUE, TRUE, 0);
+	overlay_area = da;
+
+	hbox = gtk_hbox_new(FALSE, 5);
+	gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(hbox), create_overlay_list(), TRUE, TRUE, 0);
+
+	buttons = gtk_vbox_new(FALSE, 3);
+	gtk_box_pack_start(GTK_BOX(hbox), buttons, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(buttons), overlay_button("Add dive", G_CALLBACK(add_clicked)), FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(buttons), overlay_button("Remove", G_CALLBACK(remove_clicked)), FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(buttons), overlay_button("Clear", G_CALLBACK(clear_clicked)), FALSE, FALSE, 0);
+
+	return frame;
+}
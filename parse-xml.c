@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
@@ -11,28 +13,6 @@
 
 int verbose;
 
-struct dive_table dive_table;
-
-/*
- * Add a dive into the dive_table array
- */
-static void record_dive(struct dive *dive)
-{
-	int nr = dive_table.nr, allocated = dive_table.allocated;
-	struct dive **dives = dive_table.dives;
-
-	if (nr >= allocated) {
-		allocated = (nr + 32) * 3 / 2;
-		dives = realloc(dives, allocated * sizeof(struct dive *));
-		if (!dives)
-			exit(1);
-		dive_table.dives = dives;
-		dive_table.allocated = allocated;
-	}
-	dives[nr] = fixup_dive(dive);
-	dive_table.nr = nr+1;
-}
-
 static void start_match(const char *type, const char *name, char *buffer)
 {
 	if (verbose > 2)
@@ -92,9 +72,9 @@ static struct dive *dive;
 static struct sample *sample;
 static struct tm tm;
 static int suunto, uemis;
-static int event_index, gasmix_index;
+static int event_index, gasmix_index, cylinder_index;
 
-static time_t utc_mktime(struct tm *tm)
+time_t utc_mktime(struct tm *tm)
 {
 	static const int mdays[] = {
 	    0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
@@ -279,11 +259,16 @@ static void temperature(char *buffer, void *_temperature)
 	temperature_t *temperature = _temperature;
 	union int_or_float val;
 
-	switch (integer_or_float(buffer, &val)) {
+	/* Unlike most things, it can be below zero */
+	int neg = *buffer == '-';
+
+	switch (integer_or_float(buffer + neg, &val)) {
 	case FLOAT:
 		/* Ignore zero. It means "none" */
 		if (!val.fp)
 			break;
+		if (neg)
+			val.fp = -val.fp;
 		/* Celsius */
 		switch (units.temperature) {
 		case CELSIUS:
@@ -353,6 +338,56 @@ static void gasmix(char *buffer, void *_fraction)
 		percent(buffer, _fraction);
 }
 
+/*
+ * Cylinder sizes are the water volume, in liters. A size in cubic
+ * feet is the air it holds at its working pressure instead, so we
+ * can only turn that into a water volume at the end of the dive,
+ * once we know what that pressure is.
+ */
+static int cuft_cylinders;
+
+static void volume(char *buffer, void *_volume)
+{
+	volume_t *volume = _volume;
+	union int_or_float val;
+
+	switch (integer_or_float(buffer, &val)) {
+	case FLOAT:
+		/* Zero means "don't know" */
+		if (!val.fp)
+			break;
+		switch (units.volume) {
+		case LITER:
+			volume->mliter = val.fp * 1000 + 0.5;
+			break;
+		case CUFT:
+			volume->mliter = val.fp * 28316.8 + 0.5;
+			cuft_cylinders = 1;
+			break;
+		}
+		break;
+	default:
+		printf("Strange volume reading %s\n", buffer);
+	}
+	free(buffer);
+}
+
+static void cylinder_size(char *buffer, void *_volume)
+{
+	if (cylinder_index < MAX_MIXES)
+		volume(buffer, _volume);
+	else
+		free(buffer);
+}
+
+static void cylinder_pressure(char *buffer, void *_press)
+{
+	if (cylinder_index < MAX_MIXES)
+		pressure(buffer, _press);
+	else
+		free(buffer);
+}
+
 static void gasmix_nitrogen(char *buffer, void *_gasmix)
 {
 	/* Ignore n2 percentages. There's no value in them. */
@@ -479,6 +514,23 @@ static void try_to_fill_sample(struct sample *sample, const char *name, char *bu
 	nonmatch("sample", name, buf);
 }
 
+/*
+ * Suunto gives the cylinder size in liters for a metric tank, which
+ * has no working pressure. With a working pressure, it's cubic feet
+ * of air at that pressure. The size comes first, so we've read it
+ * as liters by now.
+ */
+static void suunto_workpressure(char *buffer, void *_tank)
+{
+	tank_type_t *tank = _tank;
+
+	pressure(buffer, &tank->pressure);
+	if (!tank->pressure.mbar)
+		return;
+	tank->size.mliter = tank->size.mliter * 28.3168 + 0.5;
+	cuft_cylinders = 1;
+}
+
 /*
  * Crazy suunto xml. Look at how those o2/he things match up.
  */
@@ -491,7 +543,9 @@ static int suunto_dive_match(struct dive *dive, const char *name, int len, char
 		MATCH(".o2pct_3", percent, &dive->gasmix[2].o2) ||
 		MATCH(".hepct_2", percent, &dive->gasmix[2].he) ||
 		MATCH(".o2pct_4", percent, &dive->gasmix[3].o2) ||
-		MATCH(".hepct_3", percent, &dive->gasmix[3].he);
+		MATCH(".hepct_3", percent, &dive->gasmix[3].he) ||
+		MATCH(".cylindersize", volume, &dive->tank_type[0].size) ||
+		MATCH(".cylinderworkpressure", suunto_workpressure, &dive->tank_type[0]);
 }
 
 static int buffer_value(char *buffer)
@@ -626,6 +680,11 @@ static void try_to_fill_dive(struct dive *dive, const char *name, char *buf)
 	if (MATCH(".he", gasmix, &dive->gasmix[gasmix_index].he))
 		return;
 
+	if (MATCH(".cylinder.size", cylinder_size, &dive->tank_type[cylinder_index].size))
+		return;
+	if (MATCH(".cylinder.workpressure", cylinder_pressure, &dive->tank_type[cylinder_index].pressure))
+		return;
+
 	/* Suunto XML files are some crazy sh*t. */
 	if (suunto && suunto_dive_match(dive, name, len, buf))
 		return;
@@ -710,16 +769,41 @@ static void sanitize_gasmix(struct dive *dive)
 	}
 }
 
-static void dive_end(void)
+/* Cubic feet of air at the working pressure to liters of water volume */
+static void sanitize_cylinders(struct dive *dive)
 {
-	if (!dive)
+	int i;
+
+	if (!cuft_cylinders)
 		return;
+	cuft_cylinders = 0;
+	for (i = 0; i < MAX_MIXES; i++) {
+		tank_type_t *tank = dive->tank_type+i;
+
+		if (tank->pressure.mbar)
+			tank->size.mliter = tank->size.mliter * 1013.25 / tank->pressure.mbar + 0.5;
+		else
+			tank->size.mliter = 0;
+	}
+}
+
+static void finish_dive(struct dive *dive)
+{
 	if (!dive->name)
 		dive->name = generate_name(dive);
 	sanitize_gasmix(dive);
+	sanitize_cylinders(dive);
 	record_dive(dive);
+}
+
+static void dive_end(void)
+{
+	if (!dive)
+		return;
+	finish_dive(dive);
 	dive = NULL;
 	gasmix_index = 0;
+	cylinder_index = 0;
 }
 
 static void suunto_start(void)
@@ -761,6 +845,15 @@ static void gasmix_end(void)
 	gasmix_index++;
 }
 
+static void cylinder_start(void)
+{
+}
+
+static void cylinder_end(void)
+{
+	cylinder_index++;
+}
+
 static void sample_start(void)
 {
 	int nr;
@@ -902,6 +995,7 @@ static struct nesting {
 	{ "reading", sample_start, sample_end },
 	{ "event", event_start, event_end },
 	{ "gasmix", gasmix_start, gasmix_end },
+	{ "cylinder", cylinder_start, cylinder_end },
 	{ "pre_dive", uemis_start, uemis_end },
 	{ NULL, }
 };
@@ -942,11 +1036,507 @@ static void reset_all(void)
 	uemis = 0;
 }
 
+/*
+ * Read the whole file into memory. gzread() passes plain files
+ * through as-is, so this takes care of gzip-compressed logs too,
+ * and does it in much bigger gulps than libxml2 would.
+ */
+#define READ_SIZE (256*1024)
+
+static char *read_file(const char *filename, size_t *sizep)
+{
+	gzFile f;
+	char *buf = NULL;
+	size_t size = 0, alloc = 0;
+	int n;
+
+	f = gzopen(filename, "rb");
+	if (!f)
+		return NULL;
+	gzbuffer(f, READ_SIZE);
+	for (;;) {
+		if (alloc - size < READ_SIZE) {
+			alloc = (alloc + READ_SIZE) * 3 / 2;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				exit(1);
+		}
+		n = gzread(f, buf + size, alloc - size);
+		if (n <= 0)
+			break;
+		size += n;
+	}
+	gzclose(f);
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+	*sizep = size;
+	return buf;
+}
+
+/*
+ * Fast path for our own save format.
+ *
+ * save-xml.c writes a very rigid format, and re-opening our own
+ * logs is what we do most. So rather than building a DOM and then
+ * guessing at what every attribute means, we just walk the text and
+ * parse the values we know are there, in the units we know they
+ * were written in.
+ *
+ * Anything that doesn't look exactly like what we write (somebody
+ * edited the file by hand, say) makes us give up, throw away what
+ * we have so far, and let the generic parser deal with it.
+ */
+#define NATIVE_VERSION 1
+
+struct native {
+	const char *p, *end;
+};
+
+static void native_space(struct native *n)
+{
+	while (n->p < n->end && isspace(*n->p))
+		n->p++;
+}
+
+static int native_skip(struct native *n, const char *s)
+{
+	int len = strlen(s);
+
+	if (n->end - n->p < len || memcmp(n->p, s, len))
+		return 0;
+	n->p += len;
+	return 1;
+}
+
+/* Up to and not including 'c' */
+static const char *native_until(struct native *n, char c, int *len)
+{
+	const char *start = n->p;
+	const char *p = memchr(start, c, n->end - start);
+
+	if (!p)
+		return NULL;
+	*len = p - start;
+	n->p = p + 1;
+	return start;
+}
+
+/* "[-]digits[.digits]" as a fixed-point number with 'digits' decimals */
+static int parse_fixed(const char **pp, const char *end, int digits, int *res)
+{
+	const char *p = *pp;
+	int neg = 0, val = 0, any = 0;
+
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	while (p < end && isdigit(*p)) {
+		val = val * 10 + *p++ - '0';
+		any = 1;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isdigit(*p)) {
+			if (digits) {
+				val = val * 10 + *p - '0';
+				digits--;
+			}
+			p++;
+			any = 1;
+		}
+	}
+	while (digits--)
+		val *= 10;
+	if (!any)
+		return 0;
+	*res = neg ? -val : val;
+	*pp = p;
+	return 1;
+}
+
+/* A value, followed by exactly the given unit */
+static int native_value(const char *p, int len, int digits, const char *unit, int *res)
+{
+	const char *end = p + len;
+
+	if (!parse_fixed(&p, end, digits, res))
+		return 0;
+	len = strlen(unit);
+	return end - p == len && !memcmp(p, unit, len);
+}
+
+/* "m:ss min" */
+static int native_duration(const char *p, int len, duration_t *res)
+{
+	const char *end = p + len;
+	int min, sec;
+
+	if (!parse_fixed(&p, end, 0, &min) || p >= end || *p++ != ':')
+		return 0;
+	if (!parse_fixed(&p, end, 0, &sec))
+		return 0;
+	res->seconds = min * 60 + sec;
+	return end - p == 4 && !memcmp(p, " min", 4);
+}
+
+static int native_depth(const char *p, int len, depth_t *res)
+{
+	return native_value(p, len, 3, " m", &res->mm);
+}
+
+static int native_pressure(const char *p, int len, pressure_t *res)
+{
+	return native_value(p, len, 3, " bar", &res->mbar);
+}
+
+static int native_temperature(const char *p, int len, temperature_t *res)
+{
+	int mcelsius;
+
+	if (!native_value(p, len, 3, " C", &mcelsius))
+		return 0;
+	/* Zero means "none", like temperature() says */
+	if (mcelsius)
+		res->mkelvin = mcelsius + 273150;
+	return 1;
+}
+
+static int native_percent(const char *p, int len, fraction_t *res)
+{
+	return native_value(p, len, 1, "%", &res->permille);
+}
+
+static int native_volume(const char *p, int len, volume_t *res)
+{
+	return native_value(p, len, 3, " l", &res->mliter);
+}
+
+/* We only ever write the three entities that save-xml.c quotes */
+static char *native_text(const char *p, int len)
+{
+	const char *end = p + len;
+	char *res, *q;
+
+	while (p < end && isspace(*p))
+		p++;
+	while (end > p && isspace(end[-1]))
+		end--;
+	if (p == end)
+		return NULL;
+
+	res = q = malloc(end - p + 1);
+	if (!res)
+		exit(1);
+	while (p < end) {
+		char c = *p++;
+
+		if (c == '&') {
+			if (end - p >= 3 && !memcmp(p, "lt;", 3)) {
+				c = '<';
+				p += 3;
+			} else if (end - p >= 3 && !memcmp(p, "gt;", 3)) {
+				c = '>';
+				p += 3;
+			} else if (end - p >= 4 && !memcmp(p, "amp;", 4)) {
+				p += 4;
+			} else {
+				free(res);
+				return NULL;
+			}
+		}
+		*q++ = c;
+	}
+	*q = 0;
+	return res;
+}
+
+/*
+ * Walk the "name='value'" attributes up to the end of the tag,
+ * handing each to 'fn'.
+ */
+static int native_attributes(struct native *n, const char *close,
+	int (*fn)(const char *name, int nlen, const char *val, int vlen, void *data), void *data)
+{
+	for (;;) {
+		const char *name, *val;
+		int nlen, vlen;
+
+		native_space(n);
+		if (native_skip(n, close))
+			return 1;
+		name = native_until(n, '=', &nlen);
+		if (!name || !native_skip(n, "'"))
+			return 0;
+		val = native_until(n, '\'', &vlen);
+		if (!val || !fn(name, nlen, val, vlen, data))
+			return 0;
+	}
+}
+
+#define ATTR(s) (nlen == sizeof(s)-1 && !memcmp(name, s, nlen))
+
+static int dive_attribute(const char *name, int nlen, const char *val, int vlen, void *_tm)
+{
+	struct tm *tm = _tm;
+	char buf[32];
+
+	if (vlen >= sizeof(buf))
+		return 0;
+	memcpy(buf, val, vlen);
+	buf[vlen] = 0;
+	if (ATTR("date"))
+		return sscanf(buf, "%d-%d-%d", &tm->tm_year, &tm->tm_mon, &tm->tm_mday) == 3;
+	if (ATTR("time"))
+		return sscanf(buf, "%d:%d:%d", &tm->tm_hour, &tm->tm_min, &tm->tm_sec) == 3;
+	return 0;
+}
+
+static int gasmix_attribute(const char *name, int nlen, const char *val, int vlen, void *_mix)
+{
+	gasmix_t *mix = _mix;
+	fraction_t n2;
+
+	if (ATTR("o2"))
+		return native_percent(val, vlen, &mix->o2);
+	if (ATTR("he"))
+		return native_percent(val, vlen, &mix->he);
+	if (ATTR("n2"))
+		return native_percent(val, vlen, &n2);
+	return 0;
+}
+
+static int cylinder_attribute(const char *name, int nlen, const char *val, int vlen, void *_tank)
+{
+	tank_type_t *tank = _tank;
+
+	if (ATTR("size"))
+		return native_volume(val, vlen, &tank->size);
+	if (ATTR("workpressure"))
+		return native_pressure(val, vlen, &tank->pressure);
+	return 0;
+}
+
+static int sample_attribute(const char *name, int nlen, const char *val, int vlen, void *_sample)
+{
+	struct sample *sample = _sample;
+
+	if (ATTR("time"))
+		return native_duration(val, vlen, &sample->time);
+	if (ATTR("depth"))
+		return native_depth(val, vlen, &sample->depth);
+	if (ATTR("temp"))
+		return native_temperature(val, vlen, &sample->temperature);
+	if (ATTR("pressure"))
+		return native_pressure(val, vlen, &sample->tankpressure);
+	if (ATTR("tankindex"))
+		return native_value(val, vlen, 0, "", &sample->tankindex);
+	return 0;
+}
+
+/* "<name>value</name>" inside a dive */
+static int native_element(struct native *n, struct dive *dive)
+{
+	const char *name, *val;
+	int nlen, vlen;
+
+	name = native_until(n, '>', &nlen);
+	if (!name)
+		return 0;
+	val = native_until(n, '<', &vlen);
+	if (!val || !native_skip(n, "/") ||
+	    n->end - n->p <= nlen || memcmp(n->p, name, nlen) || n->p[nlen] != '>')
+		return 0;
+	n->p += nlen + 1;
+
+	if (ATTR("maxdepth"))
+		return native_depth(val, vlen, &dive->maxdepth);
+	if (ATTR("meandepth"))
+		return native_depth(val, vlen, &dive->meandepth);
+	if (ATTR("airtemp"))
+		return native_temperature(val, vlen, &dive->airtemp);
+	if (ATTR("watertemp"))
+		return native_temperature(val, vlen, &dive->watertemp);
+	if (ATTR("duration"))
+		return native_duration(val, vlen, &dive->duration);
+	if (ATTR("surfacetime"))
+		return native_duration(val, vlen, &dive->surfacetime);
+	if (ATTR("cylinderstartpressure"))
+		return native_pressure(val, vlen, &dive->beginning_pressure);
+	if (ATTR("cylinderendpressure"))
+		return native_pressure(val, vlen, &dive->end_pressure);
+	if (ATTR("location"))
+		return (dive->location = native_text(val, vlen)) != NULL;
+	if (ATTR("notes"))
+		return (dive->notes = native_text(val, vlen)) != NULL;
+	return 0;
+}
+
+static struct dive *native_dive(struct native *n)
+{
+	int alloc = 5, mixes = 0, cylinders = 0;
+	struct dive *dive;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (!native_attributes(n, ">", dive_attribute, &tm))
+		return NULL;
+	tm.tm_mon--;
+
+	dive = malloc(dive_size(alloc));
+	if (!dive)
+		exit(1);
+	memset(dive, 0, dive_size(alloc));
+	dive->when = utc_mktime(&tm);
+
+	for (;;) {
+		native_space(n);
+		if (native_skip(n, "</dive>"))
+			return dive;
+		if (native_skip(n, "<sample ")) {
+			struct sample *sample;
+
+			if (dive->samples >= alloc) {
+				alloc = alloc * 3 / 2 + 10;
+				dive = realloc(dive, dive_size(alloc));
+				if (!dive)
+					exit(1);
+			}
+			sample = dive->sample + dive->samples;
+			memset(sample, 0, sizeof(*sample));
+			if (!native_attributes(n, "/>", sample_attribute, sample))
+				break;
+			dive->samples++;
+			continue;
+		}
+		if (native_skip(n, "<gasmix ")) {
+			gasmix_t mix = { { 0 } };
+
+			if (!native_attributes(n, "/>", gasmix_attribute, &mix))
+				break;
+			if (mixes < MAX_MIXES)
+				dive->gasmix[mixes++] = mix;
+			continue;
+		}
+		if (native_skip(n, "<cylinder ")) {
+			tank_type_t tank = { { 0 } };
+
+			if (!native_attributes(n, "/>", cylinder_attribute, &tank))
+				break;
+			if (cylinders < MAX_MIXES)
+				dive->tank_type[cylinders++] = tank;
+			continue;
+		}
+		if (!native_skip(n, "<") || !native_element(n, dive))
+			break;
+	}
+	free(dive->location);
+	free(dive->notes);
+	free(dive);
+	return NULL;
+}
+
+static int is_native_file(const char *buf, size_t size)
+{
+	struct native n = { buf, buf + size };
+	int version;
+
+	native_space(&n);
+	if (!native_skip(&n, "<dives>"))
+		return 0;
+	native_space(&n);
+	if (!native_skip(&n, "<program name='diveclog' version='"))
+		return 0;
+	if (sscanf(n.p, "%d", &version) != 1)
+		return 0;
+	return version <= NATIVE_VERSION;
+}
+
+/*
+ * Returns 0 if it parsed the whole file, and -1 if the generic
+ * parser needs to do it instead. Nothing gets recorded unless we
+ * got all the way through.
+ */
+static int parse_native(const char *buf, size_t size)
+{
+	struct native n = { buf, buf + size };
+	struct dive **dives = NULL;
+	int i, nr = 0, alloc = 0;
+
+	native_space(&n);
+	native_skip(&n, "<dives>");
+	native_space(&n);
+	if (!native_until(&n, '>', &i) || !native_skip(&n, "</program>"))
+		return -1;
+
+	for (;;) {
+		struct dive *dive;
+
+		native_space(&n);
+		if (native_skip(&n, "</dives>"))
+			break;
+		if (!native_skip(&n, "<dive "))
+			goto fail;
+		dive = native_dive(&n);
+		if (!dive)
+			goto fail;
+		if (nr >= alloc) {
+			alloc = (nr + 32) * 3 / 2;
+			dives = realloc(dives, alloc * sizeof(*dives));
+			if (!dives)
+				exit(1);
+		}
+		dives[nr++] = dive;
+	}
+	native_space(&n);
+	if (n.p != n.end)
+		goto fail;
+
+	for (i = 0; i < nr; i++)
+		finish_dive(dives[i]);
+	free(dives);
+	return 0;
+
+fail:
+	if (verbose)
+		fprintf(stderr, "Not quite our own format, using the generic parser\n");
+	for (i = 0; i < nr; i++) {
+		free(dives[i]->location);
+		free(dives[i]->notes);
+		free(dives[i]);
+	}
+	free(dives);
+	return -1;
+}
+
 void parse_xml_file(const char *filename)
 {
 	xmlDoc *doc;
+	struct stat st;
+	char *buf;
+	size_t size;
+
+	if (!stat(filename, &st) && S_ISDIR(st.st_mode)) {
+		parse_dive_directory(filename);
+		return;
+	}
+
+	if (!parse_binary_file(filename))
+		return;
 
-	doc = xmlReadFile(filename, NULL, 0);
+	buf = read_file(filename, &size);
+	if (!buf) {
+		fprintf(stderr, "Failed to read '%s'.\n", filename);
+		return;
+	}
+	if (is_native_file(buf, size) && !parse_native(buf, size)) {
+		free(buf);
+		return;
+	}
+	doc = xmlReadMemory(buf, size, filename, NULL, 0);
+	free(buf);
 	if (!doc) {
 		fprintf(stderr, "Failed to parse '%s'.\n", filename);
 		return;
@@ -0,0 +1,846 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+#include "plot.h"
+
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+
+#define ROUND_UP(x,y) ((((x)+(y)-1)/(y))*(y))
+
+/*
+ * When showing dive profiles, we scale things to the
+ * current dive. However, we don't scale past less than
+ * 30 minutes or 90 ft, just so that small dives show
+ * up as such.
+ */
+static int round_seconds_up(int seconds)
+{
+	return MAX(30*60, ROUND_UP(seconds, 60*10));
+}
+
+static int round_feet_up(int feet)
+{
+	return MAX(90, ROUND_UP(feet+5, 15));
+}
+
+/* Time markers for a window of 'seconds': no more than two dozen of them */
+static int time_marker(int seconds)
+{
+	static const int marker[] = { 60, 5*60, 10*60, 15*60, 30*60, 60*60 };
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		if (seconds <= 24 * marker[i])
+			break;
+	}
+	return marker[i];
+}
+
+/* Scale to 0,0 -> maxx,maxy */
+#define SCALE(x,y) (x)*maxx/scalex+topx,(y)*maxy/scaley+topy
+
+/*
+ * A dive computer sampling every second or two gives thousands of
+ * samples for a few hundred pixels of width, so we don't hand them
+ * all to cairo. For every pixel column we keep the first and last
+ * sample, and the minimum and maximum in between, in the order they
+ * happened. That draws the same as the full series: every column
+ * still spans the same values, and joins up with its neighbors the
+ * same way. But the number of points now depends on the width of
+ * the drawing, not on the sample rate.
+ */
+
+static int add_column(const struct plot_point *in, int idx[4], struct plot_point *out, int n)
+{
+	int i, last = -1;
+
+	/* min and max in time order */
+	if (idx[1] > idx[2]) {
+		int tmp = idx[1];
+		idx[1] = idx[2];
+		idx[2] = tmp;
+	}
+	for (i = 0; i < 4; i++) {
+		if (idx[i] == last)
+			continue;
+		last = idx[i];
+		out[n++] = in[last];
+	}
+	return n;
+}
+
+/* The pixel column of 'sec': anything outside goes in one column on either side */
+static int column(int sec, int start, int end, int columns)
+{
+	if (sec < start)
+		return -1;
+	if (sec > end)
+		return columns + 1;
+	return (long long) (sec - start) * columns / (end - start);
+}
+
+/*
+ * Decimate 'nr' points for a plot 'columns' pixels wide showing
+ * seconds 'start' to 'end'. Returns the number of points left in
+ * 'out'.
+ */
+static int decimate(const struct plot_point *in, int nr, int start, int end, int columns, struct plot_point *out)
+{
+	int i, n = 0, col = -2;
+	int idx[4] = { 0, };		/* first, min, max, last */
+
+	for (i = 0; i < nr; i++) {
+		int value = in[i].value;
+		int c = column(in[i].sec, start, end, columns);
+
+		if (c != col) {
+			if (i)
+				n = add_column(in, idx, out, n);
+			col = c;
+			idx[0] = idx[1] = idx[2] = idx[3] = i;
+			continue;
+		}
+		idx[3] = i;
+		if (value < in[idx[1]].value)
+			idx[1] = i;
+		if (value > in[idx[2]].value)
+			idx[2] = i;
+	}
+	if (nr)
+		n = add_column(in, idx, out, n);
+	return n;
+}
+
+static void grow_series(struct plot_series *s, int nr)
+{
+	if (nr > s->allocated) {
+		s->allocated = (nr + 64) * 3 / 2;
+		s->point = realloc(s->point, s->allocated * sizeof(struct plot_point));
+		if (!s->point)
+			exit(1);
+	}
+	s->nr = 0;
+}
+
+static void add_point(struct plot_series *s, int sec, int value)
+{
+	struct plot_point *p = s->point + s->nr++;
+
+	p->sec = sec;
+	p->value = value;
+}
+
+/*
+ * When zoomed in on part of a long dive, we don't want to go through
+ * all the samples in the window either. So every series also has a
+ * pyramid of power-of-two levels: level k has the minimum and the
+ * maximum (in time order) of every 2^k points, and is built from the
+ * level below it. Level 0 is the points themselves.
+ *
+ * To draw a window, we pick the lowest level that has at most a
+ * couple of entries per pixel column in it, and decimate those. That
+ * takes time proportional to the width, however many samples the
+ * window has.
+ */
+static void merge_bucket(const struct plot_point *in, int n, struct plot_point *out)
+{
+	int i, lo = 0, hi = 0;
+
+	for (i = 1; i < n; i++) {
+		if (in[i].value < in[lo].value)
+			lo = i;
+		if (in[i].value > in[hi].value)
+			hi = i;
+	}
+	if (lo > hi) {
+		int tmp = lo;
+		lo = hi;
+		hi = tmp;
+	}
+	out[0] = in[lo];
+	out[1] = in[hi];
+}
+
+static void build_pyramid(struct plot_series *s)
+{
+	const struct plot_point *in = s->point;
+	int n = s->nr, size = 1, total = 0, k;
+
+	for (k = n; k > 1; k = (k + 1) / 2)
+		total += (k + 1) / 2;
+	if (2 * total > s->pyramid_allocated) {
+		s->pyramid_allocated = (2 * total + 64) * 3 / 2;
+		s->pyramid = realloc(s->pyramid, s->pyramid_allocated * sizeof(struct plot_point));
+		if (!s->pyramid)
+			exit(1);
+	}
+
+	/* Level 1 from the points, two at a time; then two buckets at a time */
+	s->levels = 1;
+	total = 0;
+	while (n > 1) {
+		struct plot_point *out = s->pyramid + total;
+		int i, buckets = (n + 1) / 2;
+
+		for (i = 0; i < buckets; i++) {
+			int nr = MIN(2, n - 2*i);
+			merge_bucket(in + 2*size*i, nr * size, out + 2*i);
+		}
+		s->level[s->levels++] = out;
+		total += 2 * buckets;
+		in = out;
+		size = 2;
+		n = buckets;
+	}
+}
+
+/* First point at or after 'sec' (or 'nr' if there isn't one) */
+static int find_point(const struct plot_series *s, int sec)
+{
+	int lo = 0, hi = s->nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (s->point[mid].sec < sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Add the min and max of bucket 'i' of level 'k' to 'out'. A bucket
+ * that spans more than one pixel column doesn't tell us the min and
+ * max of each of them, so that gets split into the two buckets below
+ * it, down to the points themselves if need be. Only the buckets at
+ * the column boundaries ever need that.
+ */
+static void add_bucket(const struct plot_series *in, struct plot_series *out,
+	int k, int i, int start, int end, int columns)
+{
+	const struct plot_point *p;
+	int first = i << k, last = MIN(((i + 1) << k), in->nr) - 1;
+
+	if (!k) {
+		out->point[out->nr++] = in->point[i];
+		return;
+	}
+	if (column(in->point[first].sec, start, end, columns) !=
+	    column(in->point[last].sec, start, end, columns)) {
+		add_bucket(in, out, k-1, 2*i, start, end, columns);
+		if ((2*i + 1) << (k-1) < in->nr)
+			add_bucket(in, out, k-1, 2*i + 1, start, end, columns);
+		return;
+	}
+	p = in->level[k] + 2*i;
+	out->point[out->nr++] = p[0];
+	if (p[1].sec != p[0].sec)
+		out->point[out->nr++] = p[1];
+}
+
+/* The points of 'in' between 'start' and 'end' at a level fit for 'width' */
+static void window_points(const struct plot_series *in, struct plot_series *out,
+	int start, int end, int width)
+{
+	int first, last, k, i;
+
+	/* Include the points on either side, so that the lines reach the edges */
+	first = find_point(in, start) - 1;
+	last = find_point(in, end + 1);
+	if (first < 0)
+		first = 0;
+	if (last >= in->nr)
+		last = in->nr - 1;
+
+	k = 0;
+	while (k + 1 < in->levels && ((last - first + 1) >> k) > 2 * width)
+		k++;
+
+	/* Every column boundary can split a bucket all the way down */
+	grow_series(out, 2 * ((last >> k) - (first >> k) + 1) + 2 * k * (width + 1));
+	for (i = first >> k; i <= last >> k; i++)
+		add_bucket(in, out, k, i, start, end, width);
+}
+
+/* Where the deco says we can go up to, in the units of the plot */
+static void build_ceiling(struct plot_info *pi, struct dive *dive)
+{
+	struct deco_sample *deco;
+	int i;
+
+	deco = realloc(pi->deco, (dive->samples + 1) * sizeof(*deco));
+	if (!deco)
+		exit(1);
+	pi->deco = deco;
+	deco_dive(dive, deco);
+
+	grow_series(&pi->ceiling, dive->samples);
+	pi->maxceiling = 0;
+	for (i = 0; i < dive->samples; i++) {
+		int feet = to_feet(deco[i].ceiling);
+
+		add_point(&pi->ceiling, dive->sample[i].time.seconds, feet);
+		if (feet > pi->maxceiling)
+			pi->maxceiling = feet;
+	}
+	build_pyramid(&pi->ceiling);
+}
+
+static void build_sac(struct plot_info *pi, struct dive *dive)
+{
+	struct sac_info info;
+	int *sac;
+
+	sac = realloc(pi->sac, (dive->samples + 1) * sizeof(*sac));
+	if (!sac)
+		exit(1);
+	pi->sac = sac;
+	dive_sac(dive, &info, sac);
+}
+
+/*
+ * Just the depth profile, which is all that overlaying the dive on
+ * others needs: none of the deco, gas and rate work that the full
+ * plot does on top of it.
+ */
+void build_depth_plot_info(struct plot_info *pi, struct dive *dive)
+{
+	int i;
+
+	pi->dive = dive;
+	pi->generation = dive_table.generation;
+	pi->width = 0;
+	pi->pressure.nr = pi->temperature.nr = pi->ceiling.nr = 0;
+	pi->maxpressure = 0;
+	if (!dive)
+		return;
+
+	load_samples(dive);
+	pi->maxtime = round_seconds_up(dive->duration.seconds);
+	pi->start = 0;
+	pi->end = pi->maxtime;
+	pi->maxdepth = round_feet_up(to_feet(dive->maxdepth));
+	pi->meandepth = to_feet(dive->meandepth);
+
+	grow_series(&pi->depth, dive->samples);
+	for (i = 0; i < dive->samples; i++) {
+		struct sample *sample = dive->sample + i;
+
+		add_point(&pi->depth, sample->time.seconds, to_feet(sample->depth));
+	}
+	build_pyramid(&pi->depth);
+}
+
+void build_plot_info(struct plot_info *pi, struct dive *dive)
+{
+	int i;
+
+	build_depth_plot_info(pi, dive);
+	if (!dive)
+		return;
+
+	grow_series(&pi->pressure, dive->samples);
+	grow_series(&pi->temperature, dive->samples);
+	for (i = 0; i < dive->samples; i++) {
+		struct sample *sample = dive->sample + i;
+		int mbar = sample->tankpressure.mbar;
+		int mkelvin = sample->temperature.mkelvin;
+
+		if (mbar > pi->maxpressure)
+			pi->maxpressure = mbar;
+
+		/* The first sample is the beginning pressure */
+		if (i && mbar)
+			add_point(&pi->pressure, sample->time.seconds, mbar);
+		if (mkelvin)
+			add_point(&pi->temperature, sample->time.seconds, mkelvin);
+	}
+	build_pyramid(&pi->pressure);
+	build_ceiling(pi, dive);
+	build_sac(pi, dive);
+	free(pi->violation);
+	pi->violations = rate_violations(dive, &pi->violation);
+}
+
+static void decimate_series(struct plot_info *pi, struct plot_series *in, struct plot_series *out, int width)
+{
+	struct plot_series *window = &pi->window;
+
+	window_points(in, window, pi->start, pi->end, width);
+	grow_series(out, window->nr);
+	out->nr = decimate(window->point, window->nr, pi->start, pi->end, width, out->point);
+}
+
+/* Decimate the series for a plot 'width' pixel columns wide */
+static void set_plot_width(struct plot_info *pi, int width)
+{
+	if (pi->width == width)
+		return;
+	decimate_series(pi, &pi->depth, &pi->depth_plot, width);
+	decimate_series(pi, &pi->pressure, &pi->pressure_plot, width);
+	decimate_series(pi, &pi->ceiling, &pi->ceiling_plot, width);
+	pi->width = width;
+}
+
+/*
+ * Show seconds 'start' to 'end' of the dive. The window gets moved
+ * to stay within the plot, and is never less than MIN_ZOOM seconds.
+ */
+void set_plot_view(struct plot_info *pi, int start, int end)
+{
+	int maxtime = pi->maxtime;
+
+	if (end - start < MIN_ZOOM)
+		end = start + MIN_ZOOM;
+	if (end - start > maxtime) {
+		start = 0;
+		end = maxtime;
+	}
+	if (start < 0) {
+		end -= start;
+		start = 0;
+	}
+	if (end > maxtime) {
+		start -= end - maxtime;
+		end = maxtime;
+	}
+	if (start == pi->start && end == pi->end)
+		return;
+	pi->start = start;
+	pi->end = end;
+	pi->width = 0;
+}
+
+/* The plot geometry: a margin of a 20th of the size all around */
+static double plot_left(int w)
+{
+	return w / 20.0;
+}
+
+static double plot_width(int w)
+{
+	return w - 2 * plot_left(w);
+}
+
+/* What time is at x coordinate 'x' in a plot 'w' pixels wide? */
+int plot_x_to_sec(struct plot_info *pi, int w, double x)
+{
+	return pi->start + (x - plot_left(w)) * (pi->end - pi->start) / plot_width(w);
+}
+
+static int interpolate(int a, int b, int ta, int tb, int sec)
+{
+	if (tb == ta)
+		return a;
+	return a + (long long) (b - a) * (sec - ta) / (tb - ta);
+}
+
+/* The value of a series at 'sec': zero if it doesn't have any */
+static int series_value(const struct plot_series *s, int sec)
+{
+	const struct plot_point *a, *b;
+	int i = find_point(s, sec);
+
+	if (!s->nr)
+		return 0;
+	if (i == s->nr)
+		return s->point[i-1].value;
+	b = s->point + i;
+	if (!i || b->sec == sec)
+		return b->value;
+	a = b - 1;
+	return interpolate(a->value, b->value, a->sec, b->sec, sec);
+}
+
+/*
+ * What the dive was like at 'sec', for a readout under the mouse:
+ * binary searches for the samples on either side of it, and the
+ * values interpolated between them. The temperatures and pressures
+ * come from the series of the ones actually reported, so that a dive
+ * computer that only gives them every so often doesn't read as zero
+ * in between.
+ */
+/* The first sample after 'sec' */
+static int sample_after(struct dive *dive, int sec)
+{
+	int lo = 0, hi = dive->samples;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (dive->sample[mid].time.seconds <= sec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+void plot_readout(struct plot_info *pi, int sec, struct sample *out)
+{
+	struct dive *dive = pi->dive;
+	const struct sample *a, *b;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+	out->time.seconds = sec;
+	if (!dive->samples)
+		return;
+
+	i = sample_after(dive, sec);
+	a = dive->sample + MAX(i - 1, 0);
+	b = dive->sample + MIN(i, dive->samples - 1);
+	sec = MAX(sec, a->time.seconds);
+	sec = MIN(sec, b->time.seconds);
+
+	out->depth.mm = interpolate(a->depth.mm, b->depth.mm, a->time.seconds, b->time.seconds, sec);
+	out->temperature.mkelvin = series_value(&pi->temperature, sec);
+	out->tankpressure.mbar = series_value(&pi->pressure, sec);
+
+	/* Before the pressure series, we go from the beginning pressure, like the plot */
+	if (pi->pressure.nr && sec < pi->pressure.point[0].sec && dive->beginning_pressure.mbar)
+		out->tankpressure.mbar = interpolate(dive->beginning_pressure.mbar,
+			pi->pressure.point[0].value, 0, pi->pressure.point[0].sec, sec);
+	out->tankindex = a->tankindex;
+}
+
+/* The same for the deco: the ceiling, GF and saturation at 'sec' */
+void plot_deco_readout(struct plot_info *pi, int sec, struct deco_sample *out)
+{
+	struct dive *dive = pi->dive;
+	const struct deco_sample *a, *b;
+	int i, ia, ib, ta, tb;
+
+	memset(out, 0, sizeof(*out));
+	if (!dive->samples)
+		return;
+
+	i = sample_after(dive, sec);
+	ia = MAX(i - 1, 0);
+	ib = MIN(i, dive->samples - 1);
+	a = pi->deco + ia;
+	b = pi->deco + ib;
+	ta = dive->sample[ia].time.seconds;
+	tb = dive->sample[ib].time.seconds;
+	sec = MAX(sec, ta);
+	sec = MIN(sec, tb);
+
+	out->ceiling.mm = interpolate(a->ceiling.mm, b->ceiling.mm, ta, tb, sec);
+	out->gf = interpolate(a->gf, b->gf, ta, tb, sec);
+	out->saturation = interpolate(a->saturation, b->saturation, ta, tb, sec);
+}
+
+/* ..and the consumption rate, zero if we don't know it there */
+int plot_sac_readout(struct plot_info *pi, int sec)
+{
+	struct dive *dive = pi->dive;
+	int i, ia, ib;
+
+	if (!dive->samples)
+		return 0;
+	i = sample_after(dive, sec);
+	ia = MAX(i - 1, 0);
+	ib = MIN(i, dive->samples - 1);
+	if (!pi->sac[ia] || !pi->sac[ib])
+		return 0;
+	sec = MAX(sec, dive->sample[ia].time.seconds);
+	sec = MIN(sec, dive->sample[ib].time.seconds);
+	return interpolate(pi->sac[ia], pi->sac[ib],
+		dive->sample[ia].time.seconds, dive->sample[ib].time.seconds, sec);
+}
+
+void free_plot_info(struct plot_info *pi)
+{
+	free(pi->depth.point);
+	free(pi->depth.pyramid);
+	free(pi->pressure.point);
+	free(pi->pressure.pyramid);
+	free(pi->temperature.point);
+	free(pi->deco);
+	free(pi->sac);
+	free(pi->violation);
+	free(pi->ceiling.point);
+	free(pi->ceiling.pyramid);
+	free(pi->depth_plot.point);
+	free(pi->pressure_plot.point);
+	free(pi->ceiling_plot.point);
+	free(pi->window.point);
+	memset(pi, 0, sizeof(*pi));
+}
+
+static void plot_grid(cairo_t *cr, double topx, double topy, double maxx, double maxy,
+	int start, int end, int maxdepth)
+{
+	double scalex, scaley;
+	int i, marker;
+
+	/* Time markers: every 5 min, or closer when zoomed in */
+	scalex = end - start;
+	scaley = 1.0;
+	marker = time_marker(end - start);
+	for (i = ROUND_UP(start + 1, marker); i < end; i += marker) {
+		cairo_move_to(cr, SCALE(i - start, 0));
+		cairo_line_to(cr, SCALE(i - start, 1));
+	}
+
+	/* Depth markers: every 15 ft */
+	scalex = 1.0;
+	scaley = maxdepth;
+	cairo_set_source_rgba(cr, 1, 1, 1, 0.5);
+	for (i = 15; i < maxdepth; i += 15) {
+		cairo_move_to(cr, SCALE(0, i));
+		cairo_line_to(cr, SCALE(1, i));
+	}
+	cairo_stroke(cr);
+}
+
+static void plot_box(cairo_t *cr, double topx, double topy, double maxx, double maxy)
+{
+	double scalex = 1.0, scaley = 1.0;
+
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_move_to(cr, SCALE(0,0));
+	cairo_line_to(cr, SCALE(0,1));
+	cairo_line_to(cr, SCALE(1,1));
+	cairo_line_to(cr, SCALE(1,0));
+	cairo_close_path(cr);
+	cairo_stroke(cr);
+}
+
+/* Too fast up in magenta, too fast down in blue, over the depth line */
+static void plot_violations(struct plot_info *pi, cairo_t *cr,
+	double topx, double topy, double maxx, double maxy)
+{
+	double scalex = pi->end - pi->start, scaley = pi->maxdepth;
+	const struct plot_series *s = &pi->depth_plot;
+	int i, j, start = pi->start;
+
+	for (i = 0; i < pi->violations; i++) {
+		const struct rate_violation *v = pi->violation + i;
+
+		if (v->end < pi->start || v->start > pi->end)
+			continue;
+
+		/* From the point before the range to the one after it */
+		j = find_point(s, v->start);
+		if (j)
+			j--;
+		if (j >= s->nr)
+			continue;
+		cairo_move_to(cr, SCALE(s->point[j].sec - start, s->point[j].value));
+		while (++j < s->nr) {
+			cairo_line_to(cr, SCALE(s->point[j].sec - start, s->point[j].value));
+			if (s->point[j].sec >= v->end)
+				break;
+		}
+		if (v->rate < 0)
+			cairo_set_source_rgba(cr, 1, 0.2, 1, 0.90);
+		else
+			cairo_set_source_rgba(cr, 0.3, 0.6, 1, 0.90);
+		cairo_stroke(cr);
+	}
+}
+
+static void plot_profile(struct plot_info *pi, cairo_t *cr,
+	double topx, double topy, double maxx, double maxy)
+{
+	double scalex, scaley;
+	int begins, sec;
+	int i, n;
+	struct plot_point *point;
+	int start, maxdepth;
+
+	n = pi->depth_plot.nr;
+	if (!n)
+		return;
+
+	cairo_set_line_width(cr, 2);
+
+	/* Get plot scaling limits */
+	start = pi->start;
+	maxdepth = pi->maxdepth;
+
+	plot_grid(cr, topx, topy, maxx, maxy, start, pi->end, maxdepth);
+
+	/* Show mean depth */
+	scalex = 1.0;
+	scaley = maxdepth;
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.40);
+	cairo_move_to(cr, SCALE(0, pi->meandepth));
+	cairo_line_to(cr, SCALE(1, pi->meandepth));
+	cairo_stroke(cr);
+
+	scalex = pi->end - start;
+
+	point = pi->depth_plot.point;
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.80);
+	begins = sec = point->sec - start;
+	cairo_move_to(cr, SCALE(sec, point->value));
+	for (i = 1; i < n; i++) {
+		point++;
+		sec = point->sec - start;
+		cairo_line_to(cr, SCALE(sec, point->value));
+	}
+	scaley = 1.0;
+	cairo_line_to(cr, SCALE(sec, 0));
+	cairo_line_to(cr, SCALE(begins, 0));
+	cairo_close_path(cr);
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.20);
+	cairo_fill_preserve(cr);
+	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.80);
+	cairo_stroke(cr);
+
+	plot_violations(pi, cr, topx, topy, maxx, maxy);
+}
+
+/* Where the deco says we can't go up past: shaded down from the surface */
+static void plot_ceiling(struct plot_info *pi, cairo_t *cr,
+	double topx, double topy, double maxx, double maxy)
+{
+	double scalex, scaley;
+	struct plot_point *point = pi->ceiling_plot.point;
+	int i, n = pi->ceiling_plot.nr, start = pi->start;
+
+	if (!pi->maxceiling || !n)
+		return;
+	scalex = pi->end - start;
+	scaley = pi->maxdepth;
+
+	cairo_move_to(cr, SCALE(point[0].sec - start, 0));
+	for (i = 0; i < n; i++)
+		cairo_line_to(cr, SCALE(point[i].sec - start, point[i].value));
+	cairo_line_to(cr, SCALE(point[n-1].sec - start, 0));
+	cairo_close_path(cr);
+	cairo_set_source_rgba(cr, 1, 1, 0.2, 0.20);
+	cairo_fill_preserve(cr);
+	cairo_set_source_rgba(cr, 1, 1, 0.2, 0.60);
+	cairo_set_line_width(cr, 1);
+	cairo_stroke(cr);
+}
+
+static void plot_tank_pressure(struct plot_info *pi, cairo_t *cr,
+	double topx, double topy, double maxx, double maxy)
+{
+	int i, start = pi->start;
+	double scalex, scaley;
+	struct plot_point *point = pi->pressure_plot.point;
+	struct dive *dive = pi->dive;
+
+	if (!pi->maxpressure)
+		return;
+	scalex = pi->end - start;
+	scaley = pi->maxpressure * 1.5;
+
+	cairo_set_line_width(cr, 2);
+	cairo_set_source_rgba(cr, 0.2, 1.0, 0.2, 0.80);
+
+	cairo_move_to(cr, SCALE(-start, dive->beginning_pressure.mbar));
+	for (i = 0; i < pi->pressure_plot.nr; i++)
+		cairo_line_to(cr, SCALE(point[i].sec - start, point[i].value));
+	cairo_line_to(cr, SCALE(dive->duration.seconds - start, dive->end_pressure.mbar));
+	cairo_stroke(cr);
+}
+
+void plot(cairo_t *cr, int w, int h, struct plot_info *pi)
+{
+	double topx, topy, maxx, maxy;
+
+	topx = plot_left(w);
+	topy = h / 20.0;
+	maxx = plot_width(w);
+	maxy = (h - 2*topy);
+
+	if (pi->dive) {
+		set_plot_width(pi, maxx + 1);
+
+		/* Zoomed in, the lines go past the box */
+		cairo_save(cr);
+		cairo_rectangle(cr, topx, topy, maxx, maxy);
+		cairo_clip(cr);
+
+		/* Depth profile */
+		plot_profile(pi, cr, topx, topy, maxx, maxy);
+
+		/* Deco ceiling */
+		plot_ceiling(pi, cr, topx, topy, maxx, maxy);
+
+		/* Tank pressure plot? */
+		plot_tank_pressure(pi, cr, topx, topy, maxx, maxy);
+
+		cairo_restore(cr);
+	}
+
+	/* Bounding box last */
+	plot_box(cr, topx, topy, maxx, maxy);
+}
+
+/*
+ * Dives overlaid on each other for comparing them: they all share
+ * the axes, which cover every one of them shifted by its offset.
+ * Adding a dive mostly doesn't change the (rounded-up) axes, so the
+ * dives already drawn can stay as they are.
+ */
+void plot_axes_init(struct plot_axes *axes)
+{
+	axes->start = 0;
+	axes->end = round_seconds_up(0);
+	axes->maxdepth = round_feet_up(0);
+}
+
+void plot_axes_add(struct plot_axes *axes, struct plot_info *pi, int offset)
+{
+	int end = MAX(axes->end, offset + pi->dive->duration.seconds);
+
+	/* Negative offsets: whole 10 minutes before the start */
+	if (offset < axes->start)
+		axes->start = -ROUND_UP(-offset, 60*10);
+	axes->end = axes->start + round_seconds_up(end - axes->start);
+	axes->maxdepth = MAX(axes->maxdepth, pi->maxdepth);
+}
+
+/* The grid and the box of the axes */
+void plot_axes(cairo_t *cr, int w, int h, struct plot_axes *axes)
+{
+	double topx = plot_left(w), topy = h / 20.0;
+	double maxx = plot_width(w), maxy = h - 2*topy;
+
+	cairo_set_line_width(cr, 2);
+	plot_grid(cr, topx, topy, maxx, maxy, axes->start, axes->end, axes->maxdepth);
+	plot_box(cr, topx, topy, maxx, maxy);
+}
+
+/* One dive on the axes, 'offset' seconds later than it really was */
+void plot_overlay(cairo_t *cr, int w, int h, struct plot_axes *axes,
+	struct plot_info *pi, int offset, double r, double g, double b)
+{
+	double topx = plot_left(w), topy = h / 20.0;
+	double maxx = plot_width(w), maxy = h - 2*topy;
+	double scalex = axes->end - axes->start, scaley = axes->maxdepth;
+	struct plot_point *point;
+	int i, shift = offset - axes->start;
+
+	/* Decimated for just the pixel columns the dive takes up */
+	set_plot_view(pi, 0, pi->maxtime);
+	set_plot_width(pi, (long long) (maxx + 1) * pi->maxtime / (axes->end - axes->start));
+	if (!pi->depth_plot.nr)
+		return;
+
+	cairo_save(cr);
+	cairo_rectangle(cr, topx, topy, maxx, maxy);
+	cairo_clip(cr);
+
+	point = pi->depth_plot.point;
+	cairo_move_to(cr, SCALE(point->sec + shift, point->value));
+	for (i = 1; i < pi->depth_plot.nr; i++) {
+		point++;
+		cairo_line_to(cr, SCALE(point->sec + shift, point->value));
+	}
+	cairo_set_line_width(cr, 2);
+	cairo_set_source_rgba(cr, r, g, b, 0.80);
+	cairo_stroke(cr);
+
+	cairo_restore(cr);
+}
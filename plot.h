@@ -0,0 +1,92 @@
+#ifndef PLOT_H
+#define PLOT_H
+
+#include <cairo.h>
+
+#include "deco.h"
+
+/*
+ * The profile plotting, without any GTK: it just draws into whatever
+ * cairo surface it gets handed, so the same code does the window and
+ * the image files.
+ */
+struct plot_point {
+	int sec, value;
+};
+
+struct plot_series {
+	int nr, allocated;
+	struct plot_point *point;
+
+	/* Min/max pyramid: level k has a min and max for every 2^k points */
+	int levels, pyramid_allocated;
+	struct plot_point *pyramid;
+	struct plot_point *level[32];
+};
+
+/* Don't zoom in to less than a minute */
+#define MIN_ZOOM 60
+
+/*
+ * What the plot needs from a dive, converted to the plot units and
+ * with the plot ranges worked out. It gets built once per dive, not
+ * on every redraw. The decimated series are kept for the last width
+ * we drew at, so a redraw just has to map them to the surface.
+ *
+ * There's nothing global in here, so different threads can plot
+ * different dives at the same time, each with its own plot_info.
+ */
+struct plot_info {
+	struct dive *dive;
+	unsigned int generation;
+	int maxtime, maxdepth;		/* rounded up: seconds, feet */
+	int meandepth;			/* feet */
+	int maxpressure;		/* mbar, zero for no tank pressures */
+	struct plot_series depth;	/* feet */
+	struct plot_series pressure;	/* mbar, without the first sample */
+	struct plot_series temperature;	/* mK, just the reported ones */
+
+	/* The deco at every sample, and the ceiling (feet) to plot */
+	struct deco_sample *deco;
+	int maxceiling;
+	struct plot_series ceiling;
+
+	/* Gas consumption (ml/min) over the last few minutes at every sample */
+	int *sac;
+
+	/* Where it went up or down too fast */
+	int violations;
+	struct rate_violation *violation;
+
+	/* The time window shown, the whole dive unless zoomed in */
+	int start, end;
+
+	/* Decimated for 'width' pixel columns */
+	int width;
+	struct plot_series depth_plot, pressure_plot, ceiling_plot;
+	struct plot_series window;
+};
+
+/* Common axes of overlaid dives: seconds, and feet */
+struct plot_axes {
+	int start, end;
+	int maxdepth;
+};
+
+extern void build_plot_info(struct plot_info *pi, struct dive *dive);
+extern void build_depth_plot_info(struct plot_info *pi, struct dive *dive);
+extern void free_plot_info(struct plot_info *pi);
+extern void set_plot_view(struct plot_info *pi, int start, int end);
+extern int plot_x_to_sec(struct plot_info *pi, int w, double x);
+extern void plot_readout(struct plot_info *pi, int sec, struct sample *sample);
+extern void plot_deco_readout(struct plot_info *pi, int sec, struct deco_sample *deco);
+extern int plot_sac_readout(struct plot_info *pi, int sec);
+extern void plot(cairo_t *cr, int w, int h, struct plot_info *pi);
+
+extern void plot_axes_init(struct plot_axes *axes);
+extern void plot_axes_add(struct plot_axes *axes, struct plot_info *pi, int offset);
+extern void plot_axes(cairo_t *cr, int w, int h, struct plot_axes *axes);
+extern void plot_overlay(cairo_t *cr, int w, int h, struct plot_axes *axes,
+	struct plot_info *pi, int offset, double r, double g, double b);
+
+#endif
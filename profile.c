@@ -4,174 +4,253 @@
 
 #include "dive.h"
 #include "display.h"
+#include "plot.h"
 
 int selected_dive = 0;
 
-#define ROUND_UP(x,y) ((((x)+(y)-1)/(y))*(y))
+/*
+ * The plot info of the dive we're showing. It gets built when it's
+ * first needed, and rebuilt when the dive table changed under us (a
+ * merge frees the dive we were looking at). Prerendering the neighbors
+ * of the selected dive has its own, so that it doesn't throw out the
+ * one we're showing.
+ */
+static struct plot_info plot_info, neighbor_info;
+
+/*
+ * The zoomed-in time window of the selected dive: the mouse wheel
+ * zooms in and out around the pointer, dragging pans, and a double
+ * click shows the whole dive again. Selecting another dive resets
+ * it. An 'end' of zero means the whole dive.
+ */
+static struct zoom {
+	struct dive *dive;
+	int start, end;
+} zoom;
+
+static struct {
+	double x;
+	int dragging;
+} drag;
 
 /*
- * When showing dive profiles, we scale things to the
- * current dive. However, we don't scale past less than
- * 30 minutes or 90 ft, just so that small dives show
- * up as such.
+ * The readout under the mouse. It's drawn on top of the cached
+ * plot, so moving the mouse only redraws the line and the label,
+ * from where they were to where they are now.
  */
-static int round_seconds_up(int seconds)
+#define READOUT_FONT_SIZE 12
+
+static struct hover {
+	struct dive *dive;
+	int x;
+	GdkRectangle line, label;
+	char text[128];
+} hover;
+
+void update_plot_info(struct dive *dive)
 {
-	return MAX(30*60, ROUND_UP(seconds, 60*10));
+	zoom.dive = dive;
+	zoom.start = zoom.end = 0;
 }
 
-static int round_feet_up(int feet)
+static int plot_info_valid(struct plot_info *pi, struct dive *dive)
 {
-	return MAX(90, ROUND_UP(feet+5, 15));
+	return pi->dive == dive && pi->generation == dive_table.generation;
 }
 
-/* Scale to 0,0 -> maxx,maxy */
-#define SCALE(x,y) (x)*maxx/scalex+topx,(y)*maxy/scaley+topy
-
-static void plot_profile(struct dive *dive, cairo_t *cr,
-	double topx, double topy, double maxx, double maxy)
+static struct plot_info *get_plot_info(struct dive *dive)
 {
-	double scalex, scaley;
-	int begins, sec, depth;
-	int i, samples;
-	struct sample *sample;
-	int maxtime, maxdepth;
+	struct plot_info *pi = &plot_info;
+
+	if (dive != current_dive) {
+		pi = &neighbor_info;
+	} else if (!plot_info_valid(pi, dive) && plot_info_valid(&neighbor_info, dive)) {
+		/* We went to a neighbor we prerendered: keep its plot info */
+		struct plot_info tmp = plot_info;
+		plot_info = neighbor_info;
+		neighbor_info = tmp;
+	}
+	if (!plot_info_valid(pi, dive))
+		build_plot_info(pi, dive);
+	if (dive == zoom.dive && zoom.end)
+		set_plot_view(pi, zoom.start, zoom.end);
+	else
+		set_plot_view(pi, 0, pi->maxtime);
+	return pi;
+}
 
-	samples = dive->samples;
-	if (!samples)
-		return;
+/*
+ * Rendered profiles get kept in offscreen image surfaces, so that
+ * an expose is just a blit, and the neighbors of the selected dive
+ * get rendered when we're idle, so that going up and down the list
+ * with the keyboard doesn't have to wait for the drawing.
+ *
+ * A surface is good for one dive at one size, and the dive table
+ * generation catches merges freeing the dive under us. We only keep
+ * a few of them around, throwing out the least recently used.
+ */
+#define PROFILE_CACHE_SIZE 8
 
-	cairo_set_line_width(cr, 2);
+static struct profile_cache {
+	struct dive *dive;
+	unsigned int generation;
+	int w, h;
+	int start, end;
+	unsigned int used;
+	cairo_surface_t *surface;
+} profile_cache[PROFILE_CACHE_SIZE];
 
-	/* Get plot scaling limits */
-	maxtime = round_seconds_up(dive->duration.seconds);
-	maxdepth = round_feet_up(to_feet(dive->maxdepth));
+static unsigned int profile_cache_clock;
 
-	/* Time markers: every 5 min */
-	scalex = maxtime;
-	scaley = 1.0;
-	for (i = 5*60; i < maxtime; i += 5*60) {
-		cairo_move_to(cr, SCALE(i, 0));
-		cairo_line_to(cr, SCALE(i, 1));
-	}
+static cairo_surface_t *render_profile(struct dive *dive, int w, int h)
+{
+	struct profile_cache *entry, *lru = profile_cache;
+	int start = 0, end = 0;
+	cairo_t *cr;
+	int i;
 
-	/* Depth markers: every 15 ft */
-	scalex = 1.0;
-	scaley = maxdepth;
-	cairo_set_source_rgba(cr, 1, 1, 1, 0.5);
-	for (i = 15; i < maxdepth; i += 15) {
-		cairo_move_to(cr, SCALE(0, i));
-		cairo_line_to(cr, SCALE(1, i));
+	if (dive == zoom.dive) {
+		start = zoom.start;
+		end = zoom.end;
+	}
+	for (i = 0; i < PROFILE_CACHE_SIZE; i++) {
+		entry = profile_cache + i;
+		if (entry->surface && entry->dive == dive &&
+		    entry->generation == dive_table.generation &&
+		    entry->w == w && entry->h == h &&
+		    entry->start == start && entry->end == end) {
+			entry->used = ++profile_cache_clock;
+			return entry->surface;
+		}
+		if (entry->used < lru->used)
+			lru = entry;
 	}
-	cairo_stroke(cr);
 
-	/* Show mean depth */
-	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.40);
-	cairo_move_to(cr, SCALE(0, to_feet(dive->meandepth)));
-	cairo_line_to(cr, SCALE(1, to_feet(dive->meandepth)));
-	cairo_stroke(cr);
+	if (lru->surface)
+		cairo_surface_destroy(lru->surface);
+	lru->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+	lru->dive = dive;
+	lru->generation = dive_table.generation;
+	lru->w = w;
+	lru->h = h;
+	lru->start = start;
+	lru->end = end;
+	lru->used = ++profile_cache_clock;
+
+	cr = cairo_create(lru->surface);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+	cairo_paint(cr);
+	plot(cr, w, h, get_plot_info(dive));
+	cairo_destroy(cr);
 
-	scalex = maxtime;
-
-	sample = dive->sample;
-	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.80);
-	begins = sample->time.seconds;
-	cairo_move_to(cr, SCALE(sample->time.seconds, to_feet(sample->depth)));
-	for (i = 1; i < dive->samples; i++) {
-		sample++;
-		sec = sample->time.seconds;
-		depth = to_feet(sample->depth);
-		cairo_line_to(cr, SCALE(sec, depth));
-	}
-	scaley = 1.0;
-	cairo_line_to(cr, SCALE(sec, 0));
-	cairo_line_to(cr, SCALE(begins, 0));
-	cairo_close_path(cr);
-	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.20);
-	cairo_fill_preserve(cr);
-	cairo_set_source_rgba(cr, 1, 0.2, 0.2, 0.80);
-	cairo_stroke(cr);
+	return lru->surface;
 }
 
-static int get_tank_pressure_range(struct dive *dive, double *scalex, double *scaley)
-{
-	int i;
-	double min, max;
-
-	*scalex = round_seconds_up(dive->duration.seconds);
-
-	max = 0;
-	min = 5000;
-	for (i = 0; i < dive->samples; i++) {
-		struct sample *sample = dive->sample + i;
-		double bar;
-
-		if (!sample->tankpressure.mbar)
-			continue;
-		bar = sample->tankpressure.mbar;
-		if (bar < min)
-			min = bar;
-		if (bar > max)
-			max = bar;
-	}
-	if (!max)
-		return 0;
-	*scaley = max * 1.5;
-	return 1;
-}
+static struct dive *prerendered;
 
-static void plot_tank_pressure(struct dive *dive, cairo_t *cr,
-	double topx, double topy, double maxx, double maxy)
+static gboolean prerender_neighbors(gpointer data)
 {
-	int i;
-	double scalex, scaley;
+	GtkWidget *widget = data;
+	int w = widget->allocation.width;
+	int h = widget->allocation.height;
+	struct dive *dive;
 
-	if (!get_tank_pressure_range(dive, &scalex, &scaley))
-		return;
-
-	cairo_set_source_rgba(cr, 0.2, 1.0, 0.2, 0.80);
+	dive = get_dive(selected_dive + 1);
+	if (dive)
+		render_profile(dive, w, h);
+	dive = get_dive(selected_dive - 1);
+	if (dive)
+		render_profile(dive, w, h);
+	return FALSE;
+}
 
-	cairo_move_to(cr, SCALE(0, dive->beginning_pressure.mbar));
-	for (i = 1; i < dive->samples; i++) {
-		int sec, mbar;
-		struct sample *sample = dive->sample + i;
+static void draw_readout(cairo_t *cr, int h)
+{
+	GdkRectangle *label = &hover.label;
 
-		sec = sample->time.seconds;
-		mbar = sample->tankpressure.mbar;
-		if (!mbar)
-			continue;
-		cairo_line_to(cr, SCALE(sec, mbar));
-	}
-	cairo_line_to(cr, SCALE(dive->duration.seconds, dive->end_pressure.mbar));
+	cairo_set_line_width(cr, 1);
+	cairo_set_source_rgba(cr, 1, 1, 1, 0.6);
+	cairo_move_to(cr, hover.x + 0.5, 0);
+	cairo_line_to(cr, hover.x + 0.5, h);
 	cairo_stroke(cr);
+
+	cairo_set_source_rgba(cr, 0, 0, 0, 0.7);
+	gdk_cairo_rectangle(cr, label);
+	cairo_fill(cr);
+	cairo_set_source_rgb(cr, 1, 1, 1);
+	cairo_set_font_size(cr, READOUT_FONT_SIZE);
+	cairo_move_to(cr, label->x + 4, label->y + label->height - 5);
+	cairo_show_text(cr, hover.text);
 }
 
-static void plot(cairo_t *cr, int w, int h, struct dive *dive)
+static void hide_readout(GtkWidget *widget)
 {
-	double topx, topy, maxx, maxy;
-	double scalex, scaley;
+	if (!hover.dive)
+		return;
+	gdk_window_invalidate_rect(widget->window, &hover.line, FALSE);
+	gdk_window_invalidate_rect(widget->window, &hover.label, FALSE);
+	hover.dive = NULL;
+}
 
-	topx = w / 20.0;
-	topy = h / 20.0;
-	maxx = (w - 2*topx);
-	maxy = (h - 2*topy);
+static void update_readout(GtkWidget *widget, double x)
+{
+	int w = widget->allocation.width;
+	int h = widget->allocation.height;
+	struct plot_info *pi = get_plot_info(current_dive);
+	cairo_text_extents_t extents;
+	struct sample sample;
+	struct deco_sample deco;
+	int sec, len, sac;
+	cairo_t *cr;
 
-	/* Depth profile */
-	plot_profile(dive, cr, topx, topy, maxx, maxy);
+	hide_readout(widget);
+	sec = plot_x_to_sec(pi, w, x);
+	if (sec < pi->start || sec > pi->end)
+		return;
 
-	/* Tank pressure plot? */
-	plot_tank_pressure(dive, cr, topx, topy, maxx, maxy);
+	plot_readout(pi, sec, &sample);
+	len = snprintf(hover.text, sizeof(hover.text), "%d:%02d  %d ft",
+		sec / 60, sec % 60, to_feet(sample.depth));
+	if (sample.temperature.mkelvin)
+		len += snprintf(hover.text + len, sizeof(hover.text) - len, "  %d C",
+			to_C(sample.temperature));
+	if (sample.tankpressure.mbar)
+		len += snprintf(hover.text + len, sizeof(hover.text) - len, "  %d psi",
+			to_PSI(sample.tankpressure));
+
+	plot_deco_readout(pi, sec, &deco);
+	if (deco.ceiling.mm)
+		len += snprintf(hover.text + len, sizeof(hover.text) - len, "  ceiling %d ft",
+			to_feet(deco.ceiling));
+	len += snprintf(hover.text + len, sizeof(hover.text) - len, "  GF %d%%", deco.gf);
+
+	sac = plot_sac_readout(pi, sec);
+	if (sac)
+		snprintf(hover.text + len, sizeof(hover.text) - len, "  SAC %.1f l/min",
+			sac / 1000.0);
 
-	/* Bounding box last */
-	scalex = scaley = 1.0;
-	cairo_set_source_rgb(cr, 1, 1, 1);
-	cairo_move_to(cr, SCALE(0,0));
-	cairo_line_to(cr, SCALE(0,1));
-	cairo_line_to(cr, SCALE(1,1));
-	cairo_line_to(cr, SCALE(1,0));
-	cairo_close_path(cr);
-	cairo_stroke(cr);
+	cr = gdk_cairo_create(widget->window);
+	cairo_set_font_size(cr, READOUT_FONT_SIZE);
+	cairo_text_extents(cr, hover.text, &extents);
+	cairo_destroy(cr);
 
+	hover.dive = current_dive;
+	hover.x = x;
+	hover.line.x = hover.x - 1;
+	hover.line.y = 0;
+	hover.line.width = 3;
+	hover.line.height = h;
+
+	/* Right of the line if it fits, left of it if not */
+	hover.label.width = extents.x_advance + 8;
+	hover.label.height = READOUT_FONT_SIZE + 8;
+	hover.label.x = hover.x + 6;
+	if (hover.label.x + hover.label.width > w)
+		hover.label.x = hover.x - 6 - hover.label.width;
+	hover.label.y = h / 20;
+
+	gdk_window_invalidate_rect(widget->window, &hover.line, FALSE);
+	gdk_window_invalidate_rect(widget->window, &hover.label, FALSE);
 }
 
 static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event, gpointer data)
@@ -184,14 +263,113 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *event, gpointer
 	h = widget->allocation.height;
 
 	cr = gdk_cairo_create(widget->window);
-	cairo_set_source_rgb(cr, 0, 0, 0);
-	cairo_paint(cr);
+	gdk_cairo_region(cr, event->region);
+	cairo_clip(cr);
 
 	if (dive)
-		plot(cr, w, h, dive);
+		cairo_set_source_surface(cr, render_profile(dive, w, h), 0, 0);
+	else
+		cairo_set_source_rgb(cr, 0, 0, 0);
+	cairo_paint(cr);
+
+	if (dive && hover.dive == dive)
+		draw_readout(cr, h);
 
 	cairo_destroy(cr);
 
+	/* The idle callback runs after the redraw is done */
+	if (dive && dive != prerendered) {
+		prerendered = dive;
+		g_idle_add(prerender_neighbors, widget);
+	}
+
+	return FALSE;
+}
+
+static void zoom_profile(GtkWidget *widget, int start, int end)
+{
+	struct plot_info *pi = get_plot_info(current_dive);
+
+	set_plot_view(pi, start, end);
+	zoom.dive = current_dive;
+	zoom.start = pi->start;
+	zoom.end = pi->end;
+
+	/* All of it is the same as not zoomed in, to the cache */
+	if (!zoom.start && zoom.end == pi->maxtime)
+		zoom.end = 0;
+	gtk_widget_queue_draw(widget);
+}
+
+static gboolean scroll_event(GtkWidget *widget, GdkEventScroll *event, gpointer data)
+{
+	int w = widget->allocation.width;
+	struct plot_info *pi;
+	int sec, span, new;
+
+	if (!current_dive)
+		return FALSE;
+	pi = get_plot_info(current_dive);
+	span = pi->end - pi->start;
+	if (event->direction == GDK_SCROLL_UP)
+		new = span / 2;
+	else if (event->direction == GDK_SCROLL_DOWN)
+		new = span * 2;
+	else
+		return FALSE;
+
+	/* Keep the time under the pointer where it is */
+	sec = plot_x_to_sec(pi, w, event->x);
+	sec -= (long long) (sec - pi->start) * new / span;
+	zoom_profile(widget, sec, sec + new);
+	return TRUE;
+}
+
+static gboolean button_press_event(GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+	if (!current_dive || event->button != 1)
+		return FALSE;
+	if (event->type == GDK_2BUTTON_PRESS) {
+		zoom.end = 0;
+		gtk_widget_queue_draw(widget);
+		return TRUE;
+	}
+	drag.x = event->x;
+	drag.dragging = 1;
+	return TRUE;
+}
+
+static gboolean button_release_event(GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+	if (event->button == 1)
+		drag.dragging = 0;
+	return FALSE;
+}
+
+static gboolean motion_notify_event(GtkWidget *widget, GdkEventMotion *event, gpointer data)
+{
+	int w = widget->allocation.width;
+	struct plot_info *pi;
+	int delta;
+
+	if (!current_dive)
+		return FALSE;
+	if (drag.dragging) {
+		pi = get_plot_info(current_dive);
+		delta = plot_x_to_sec(pi, w, drag.x) - plot_x_to_sec(pi, w, event->x);
+		if (delta) {
+			zoom_profile(widget, pi->start + delta, pi->end + delta);
+			drag.x = event->x;
+		}
+	}
+	update_readout(widget, event->x);
+	return TRUE;
+}
+
+static gboolean leave_notify_event(GtkWidget *widget, GdkEventCrossing *event, gpointer data)
+{
+	if (!drag.dragging)
+		hide_readout(widget);
 	return FALSE;
 }
 
@@ -205,6 +383,15 @@ GtkWidget *dive_profile_frame(void)
 	da = gtk_drawing_area_new();
 	gtk_widget_set_size_request(da, 450, 350);
 	g_signal_connect(da, "expose_event", G_CALLBACK(expose_event), NULL);
+
+	/* Zooming and panning, and the readout under the mouse */
+	gtk_widget_add_events(da, GDK_SCROLL_MASK | GDK_BUTTON_PRESS_MASK |
+		GDK_BUTTON_RELEASE_MASK | GDK_POINTER_MOTION_MASK | GDK_LEAVE_NOTIFY_MASK);
+	g_signal_connect(da, "scroll_event", G_CALLBACK(scroll_event), NULL);
+	g_signal_connect(da, "button_press_event", G_CALLBACK(button_press_event), NULL);
+	g_signal_connect(da, "button_release_event", G_CALLBACK(button_release_event), NULL);
+	g_signal_connect(da, "motion_notify_event", G_CALLBACK(motion_notify_event), NULL);
+	g_signal_connect(da, "leave_notify_event", G_CALLBACK(leave_notify_event), NULL);
 	gtk_container_add(GTK_CONTAINER(frame), da);
 
 	return frame;
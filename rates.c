@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+
+/*
+ * How fast the dive went up and down, and where that was faster than
+ * the limits.
+ *
+ * The rate at a sample is the depth change since the last sample at
+ * least RATE_WINDOW seconds before it, so that the depth noise of a
+ * computer sampling every couple of seconds doesn't count as a rocket
+ * ascent. Finding where that window starts is a trailing pointer, but
+ * after that every sample is the same arithmetic on its own, so that
+ * goes a block of samples at a time in vectors, like the deco does.
+ *
+ * What comes out is just the list of time ranges that broke a limit,
+ * a handful per dive at most, which is what the plot colors in.
+ */
+#define RATE_WINDOW 30
+#define LANES 8
+
+/* m/min, but in mm */
+int ascent_limit = 10000, descent_limit = 30000;
+
+typedef float vec __attribute__((vector_size(LANES * sizeof(float)), aligned(sizeof(float))));
+typedef int ivec __attribute__((vector_size(LANES * sizeof(int)), aligned(sizeof(int))));
+
+struct rate_list {
+	int nr, allocated;
+	struct rate_violation *v;
+
+	/* The one we're in, if any */
+	int open;
+};
+
+/* mm/min, negative going up, and which limit that breaks: -1, 0 or 1 */
+static void block_rates(const vec *depth, const vec *time, vec *rate, ivec *over)
+{
+	float up = -ascent_limit, down = descent_limit;
+
+	*rate = *depth * 60 / *time;
+	/* Vector compares are -1 for true */
+	*over = (*rate < up) - (*rate > down);
+}
+
+static void add_rate(struct rate_list *list, int over, int rate, int start, int end)
+{
+	struct rate_violation *v;
+
+	if (!over) {
+		list->open = 0;
+		return;
+	}
+
+	/* Still going the same way? Then it's the same stretch */
+	if (list->open) {
+		v = list->v + list->nr - 1;
+		if ((v->rate < 0) == (over < 0)) {
+			v->end = end;
+			if (abs(rate) > abs(v->rate))
+				v->rate = rate;
+			return;
+		}
+	}
+
+	if (list->nr >= list->allocated) {
+		int allocated = (list->nr + 4) * 3 / 2;
+		v = realloc(list->v, allocated * sizeof(*v));
+		if (!v)
+			exit(1);
+		list->v = v;
+		list->allocated = allocated;
+	}
+	v = list->v + list->nr++;
+	v->start = start;
+	v->end = end;
+	v->rate = rate;
+	list->open = 1;
+}
+
+/*
+ * The stretches of 'dive' that went up or down faster than the limits,
+ * in a malloc'ed list (NULL if there aren't any). Returns how many.
+ */
+int rate_violations(struct dive *dive, struct rate_violation **res)
+{
+	struct rate_list list = { 0 };
+	int i, j = 0, nr;
+
+	load_samples(dive);
+	nr = dive->samples;
+	for (i = 0; i < nr; i += LANES) {
+		vec depth, time, rate;
+		ivec over;
+		int k;
+
+		/* Where the window of each sample starts: the start of the dive is at the surface */
+		for (k = 0; k < LANES; k++) {
+			const struct sample *s = dive->sample + i + k;
+			int base_depth = 0, base_time = 0;
+
+			depth[k] = 0;
+			time[k] = 1;
+			if (i + k >= nr)
+				continue;
+			while (j < i + k && dive->sample[j+1].time.seconds <= s->time.seconds - RATE_WINDOW)
+				j++;
+			if (dive->sample[j].time.seconds <= s->time.seconds - RATE_WINDOW) {
+				base_depth = dive->sample[j].depth.mm;
+				base_time = dive->sample[j].time.seconds;
+			}
+			if (s->time.seconds <= base_time)
+				continue;
+			depth[k] = s->depth.mm - base_depth;
+			time[k] = s->time.seconds - base_time;
+		}
+
+		block_rates(&depth, &time, &rate, &over);
+
+		for (k = 0; k < LANES && i + k < nr; k++) {
+			int end = dive->sample[i + k].time.seconds;
+			int start = i + k ? dive->sample[i + k - 1].time.seconds : 0;
+
+			add_rate(&list, over[k], rate[k], start, end);
+		}
+	}
+	*res = list.v;
+	return list.nr;
+}
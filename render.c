@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <cairo.h>
+#include <cairo-svg.h>
+#include <cairo-pdf.h>
+
+#include "dive.h"
+#include "plot.h"
+
+/*
+ * Batch rendering of the dive profiles into image files, one per
+ * dive, without any GTK (and without a display).
+ *
+ * Every dive gets plotted on its own, so a number of threads each
+ * just grab the next dive to do, with their own plot info and
+ * their own cairo surface.
+ */
+enum render_format { RENDER_PNG, RENDER_SVG, RENDER_PDF };
+
+static const char *const render_ext[] = { "png", "svg", "pdf" };
+
+static struct render_state {
+	pthread_mutex_t lock;
+	const char *dir;
+	enum render_format format;
+	int w, h;
+	int next;
+	int error;
+} render_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* "2011-03-20-102238.png", just like the dive directory files */
+static void render_file_name(struct render_state *s, struct dive *dive, char *path, int len)
+{
+	struct tm tm;
+
+	gmtime_r(&dive->when, &tm);
+	snprintf(path, len, "%s/%04u-%02u-%02u-%02u%02u%02u.%s", s->dir,
+		tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec,
+		render_ext[s->format]);
+}
+
+static int render_dive(struct render_state *s, struct plot_info *pi, struct dive *dive)
+{
+	char path[PATH_MAX];
+	cairo_surface_t *surface;
+	cairo_status_t status;
+	cairo_t *cr;
+
+	render_file_name(s, dive, path, sizeof(path));
+	switch (s->format) {
+	case RENDER_SVG:
+		surface = cairo_svg_surface_create(path, s->w, s->h);
+		break;
+	case RENDER_PDF:
+		surface = cairo_pdf_surface_create(path, s->w, s->h);
+		break;
+	default:
+		surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, s->w, s->h);
+		break;
+	}
+
+	build_plot_info(pi, dive);
+	cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+	cairo_paint(cr);
+	plot(cr, s->w, s->h, pi);
+	cairo_destroy(cr);
+
+	if (s->format == RENDER_PNG) {
+		status = cairo_surface_write_to_png(surface, path);
+	} else {
+		/* The vector surfaces write out the file when they're finished */
+		cairo_surface_finish(surface);
+		status = cairo_surface_status(surface);
+	}
+	cairo_surface_destroy(surface);
+
+	if (status != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to render '%s': %s\n", path, cairo_status_to_string(status));
+		return -1;
+	}
+	return 0;
+}
+
+static void *render_worker(void *unused)
+{
+	struct render_state *s = &render_state;
+	struct plot_info pi = { NULL, };
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->error && s->next < dive_table.nr) {
+		struct dive *dive = get_dive(s->next++);
+		int err;
+
+		pthread_mutex_unlock(&s->lock);
+		err = render_dive(s, &pi, dive);
+		pthread_mutex_lock(&s->lock);
+
+		if (err)
+			s->error = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	free_plot_info(&pi);
+	return NULL;
+}
+
+static void render_parallel(int threads)
+{
+	pthread_t thread[threads];
+	int started;
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(thread + started, NULL, render_worker, NULL))
+			break;
+	}
+	/* Couldn't start any? Just do it ourselves, then */
+	if (!started)
+		render_worker(NULL);
+	while (started)
+		pthread_join(thread[--started], NULL);
+}
+
+static int parse_render_format(const char *format)
+{
+	int i;
+
+	for (i = 0; i < sizeof(render_ext) / sizeof(render_ext[0]); i++) {
+		if (!strcmp(format, render_ext[i]))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Render the profile of every dive in the dive table into directory
+ * 'dir', as 'format' ("png", "svg" or "pdf") images of w x h pixels
+ * (points for the vector formats). This uses the save threads.
+ *
+ * Returns 0 on success.
+ */
+int render_dives(const char *dir, const char *format, int w, int h)
+{
+	struct render_state *s = &render_state;
+	int threads = save_threads;
+	int fmt = parse_render_format(format);
+
+	if (fmt < 0) {
+		fprintf(stderr, "Unknown image format '%s'\n", format);
+		return -1;
+	}
+	if (w <= 0 || h <= 0) {
+		fprintf(stderr, "Bad image size %dx%d\n", w, h);
+		return -1;
+	}
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+
+	s->dir = dir;
+	s->format = fmt;
+	s->w = w;
+	s->h = h;
+	s->next = 0;
+	s->error = 0;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > dive_table.nr)
+		threads = dive_table.nr;
+	/* Every dive needs what the dives before it left in the tissues */
+	update_chain();
+	if (threads > 1)
+		render_parallel(threads);
+	else
+		render_worker(NULL);
+	return s->error ? -1 : 0;
+}
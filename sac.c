@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dive.h"
+
+/*
+ * Gas consumption from the tank pressure samples.
+ *
+ * We go through the samples once, integrating the ambient pressure
+ * over time as we go, in total and per depth band. Every pressure
+ * reading of a tank then tells us how much gas went since the last
+ * reading of that tank, and the exposure since then is just the
+ * difference of the running integrals, so that's all we need to
+ * remember per tank. The gas gets split over the depth bands the
+ * same way that exposure was.
+ *
+ * The sliding window rate for the profile needs the gas used up to
+ * every sample, and a reading only tells us about the samples since
+ * the last one after the fact. So for that we keep the running
+ * totals per sample, and spread the gas of a reading over the
+ * samples it covers by their exposure.
+ */
+#define SAC_WINDOW (5*60)
+#define SURFACE_MBAR 1013
+
+static int ambient(depth_t depth)
+{
+	return SURFACE_MBAR + depth.mm / 10;
+}
+
+static int depth_band(depth_t depth)
+{
+	int band = depth.mm / DEPTH_BAND;
+
+	if (band < 0)
+		return 0;
+	if (band >= NR_DEPTH_BANDS)
+		return NR_DEPTH_BANDS - 1;
+	return band;
+}
+
+/* The last reading of a tank, and the exposure up to it. Sample -1 is the start */
+struct tank_reading {
+	int mbar, sample;
+	long long exposure, band_exposure[NR_DEPTH_BANDS];
+};
+
+struct sac_pass {
+	struct dive *dive;
+	struct sac_info *info;
+	struct tank_reading tank[MAX_MIXES];
+	int unknown, first, last;
+
+	/* Running totals per sample, only for the window */
+	long long *gas, *exposure;
+};
+
+static void integrate(struct sac_info *info, const struct sample *a, const struct sample *b)
+{
+	int dt = b->time.seconds - a->time.seconds;
+	depth_t mid;
+	long long e;
+
+	if (dt <= 0)
+		return;
+	mid.mm = (a->depth.mm + b->depth.mm) / 2;
+	e = (long long) (ambient(a->depth) + ambient(b->depth)) * dt / 2;
+	info->exposure += e;
+	info->band_exposure[depth_band(mid)] += e;
+}
+
+/* Spread the gas since sample 'from' over the samples up to 'to' */
+static void spread(struct sac_pass *p, int from, int to, long long gas)
+{
+	long long base = from < 0 ? 0 : p->exposure[from];
+	long long total = p->exposure[to] - base;
+	int i;
+
+	for (i = from + 1; i < to; i++) {
+		if (total > 0)
+			p->gas[i] += gas * (double) (p->exposure[i] - base) / total;
+	}
+	p->gas[to] += gas;
+}
+
+static void reading(struct sac_pass *p, int idx, int mbar, int i)
+{
+	struct sac_info *info = p->info;
+	struct tank_reading *t;
+	long long gas, exposure, left;
+	int b, size;
+
+	if (idx < 0 || idx >= MAX_MIXES) {
+		p->unknown = 1;
+		return;
+	}
+	t = p->tank + idx;
+	if (!t->mbar) {
+		if (p->first > i)
+			p->first = i;
+		goto remember;
+	}
+	size = p->dive->tank_type[idx].size.mliter;
+	if (!size) {
+		if (t->mbar != mbar)
+			p->unknown = 1;
+		goto remember;
+	}
+
+	gas = (long long) (t->mbar - mbar) * size;
+	info->gas += gas;
+	exposure = info->exposure - t->exposure;
+	left = gas;
+	for (b = 0; b < NR_DEPTH_BANDS && exposure > 0; b++) {
+		long long part = gas * (double) (info->band_exposure[b] - t->band_exposure[b]) / exposure;
+		info->band_gas[b] += part;
+		left -= part;
+	}
+	info->band_gas[depth_band(p->dive->sample[i].depth)] += left;
+	if (p->gas)
+		spread(p, t->sample, i, gas);
+
+remember:
+	t->mbar = mbar;
+	t->sample = i;
+	t->exposure = info->exposure;
+	memcpy(t->band_exposure, info->band_exposure, sizeof(t->band_exposure));
+	if (p->last < i)
+		p->last = i;
+}
+
+/* The rate over the last SAC_WINDOW seconds, where we know it */
+static void fill_window(struct sac_pass *p, int *window)
+{
+	struct dive *dive = p->dive;
+	int i, j = 0;
+
+	for (i = 0; i < dive->samples; i++) {
+		int start = dive->sample[i].time.seconds - SAC_WINDOW;
+		int base;
+
+		while (dive->sample[j].time.seconds < start)
+			j++;
+		base = j - 1;
+		if (base < p->first)
+			base = p->first;
+		if (i > p->last || base >= i)
+			continue;
+		if (base < 0)
+			window[i] = sac_rate(p->gas[i], p->exposure[i]);
+		else
+			window[i] = sac_rate(p->gas[i] - p->gas[base], p->exposure[i] - p->exposure[base]);
+	}
+}
+
+/* No samples, just the start and end pressures over the whole dive */
+static int sac_without_samples(struct dive *dive, struct sac_info *info)
+{
+	int size = dive->tank_type[0].size.mliter;
+	int band = depth_band(dive->meandepth);
+	long long exposure;
+
+	exposure = (long long) ambient(dive->meandepth) * dive->duration.seconds;
+	info->exposure = info->band_exposure[band] = exposure;
+	if (!size || !dive->beginning_pressure.mbar || !dive->end_pressure.mbar || !exposure)
+		return -1;
+	info->gas = info->band_gas[band] = (long long) (dive->beginning_pressure.mbar - dive->end_pressure.mbar) * size;
+	return 0;
+}
+
+/*
+ * The consumption of 'dive', and if 'window' isn't NULL, the rate
+ * (ml/min) over the last few minutes at every sample of it, with
+ * zero where we can't tell. Returns -1 if there's nothing to go
+ * on: no tank pressures, or no cylinder size for a tank that got
+ * used.
+ */
+int dive_sac(struct dive *dive, struct sac_info *info, int *window)
+{
+	struct sac_pass p;
+	struct sample prev = { { 0 } };
+	int i, nr;
+
+	memset(info, 0, sizeof(*info));
+	load_samples(dive);
+	nr = dive->samples;
+	if (window)
+		memset(window, 0, nr * sizeof(*window));
+	if (!nr)
+		return sac_without_samples(dive, info);
+
+	memset(&p, 0, sizeof(p));
+	p.dive = dive;
+	p.info = info;
+	p.first = nr;
+	p.last = -1;
+	if (window) {
+		p.gas = calloc(2 * nr, sizeof(long long));
+		if (!p.gas)
+			exit(1);
+		p.exposure = p.gas + nr;
+	}
+
+	/* The start pressure is a reading of the first tank before the first sample */
+	if (dive->beginning_pressure.mbar) {
+		p.tank[0].mbar = dive->beginning_pressure.mbar;
+		p.tank[0].sample = -1;
+		p.first = -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct sample *s = dive->sample + i;
+
+		integrate(info, &prev, s);
+		prev = *s;
+		if (p.gas) {
+			p.exposure[i] = info->exposure;
+			p.gas[i] = i ? p.gas[i-1] : 0;
+		}
+		if (s->tankpressure.mbar)
+			reading(&p, s->tankindex, s->tankpressure.mbar, i);
+	}
+
+	/* ..and the end pressure one after the last */
+	if (dive->end_pressure.mbar && p.tank[0].mbar)
+		reading(&p, 0, dive->end_pressure.mbar, nr - 1);
+
+	if (p.unknown || info->gas <= 0) {
+		free(p.gas);
+		return -1;
+	}
+	if (window)
+		fill_window(&p, window);
+	free(p.gas);
+	return 0;
+}
+
+/*
+ * Consumption per year, for the statistics. Working that out means
+ * unpacking the samples of every dive, so we don't do it until
+ * somebody asks, but from then on the index hooks keep it up to
+ * date as dives come and go. Like the other indexes, this expects
+ * the dive table to be locked.
+ */
+static struct sac_years {
+	int built, nr, allocated;
+	struct sac_year *year;
+} years;
+
+static int find_year(int year, int create)
+{
+	int lo = 0, hi = years.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (years.year[mid].year < year)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < years.nr && years.year[lo].year == year)
+		return lo;
+	if (!create)
+		return -1;
+
+	if (years.nr >= years.allocated) {
+		int allocated = (years.nr + 8) * 3 / 2;
+		struct sac_year *y = realloc(years.year, allocated * sizeof(*y));
+		if (!y)
+			exit(1);
+		years.year = y;
+		years.allocated = allocated;
+	}
+	memmove(years.year + lo + 1, years.year + lo, (years.nr - lo) * sizeof(*years.year));
+	memset(years.year + lo, 0, sizeof(*years.year));
+	years.year[lo].year = year;
+	years.nr++;
+	return lo;
+}
+
+static void account(struct dive *dive, int sign)
+{
+	struct sac_info info;
+	struct sac_year *y;
+	struct tm tm;
+	int idx;
+
+	if (dive_sac(dive, &info, NULL) < 0)
+		return;
+	gmtime_r(&dive->when, &tm);
+	idx = find_year(tm.tm_year + 1900, sign > 0);
+	if (idx < 0)
+		return;
+	y = years.year + idx;
+	y->dives += sign;
+	y->gas += sign * info.gas;
+	y->exposure += sign * info.exposure;
+	if (!y->dives) {
+		years.nr--;
+		memmove(y, y + 1, (years.nr - idx) * sizeof(*y));
+	}
+}
+
+void index_dive_sac(struct dive *dive)
+{
+	if (years.built)
+		account(dive, 1);
+}
+
+void unindex_dive_sac(struct dive *dive)
+{
+	if (years.built)
+		account(dive, -1);
+}
+
+const struct sac_year *sac_years(int *nr)
+{
+	int i;
+
+	if (!years.built) {
+		years.built = 1;
+		for (i = 0; i < dive_table.nr; i++)
+			account(dive_table.dives[i], 1);
+	}
+	*nr = years.nr;
+	return years.year;
+}
@@ -1,43 +1,70 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <zlib.h>
 
 #include "dive.h"
+#include "membuffer.h"
 
-#define FRACTION(n,x) ((unsigned)(n)/(x)),((unsigned)(n)%(x))
+/* "%u.%03u" without going through printf */
+static void put_milli(struct membuffer *b, unsigned int n)
+{
+	put_fraction(b, n, 1000, '.', 3);
+}
 
-static void show_temperature(FILE *f, temperature_t temp, const char *pre, const char *post)
+static void show_temperature(struct membuffer *b, temperature_t temp, const char *pre, const char *post)
 {
 	if (temp.mkelvin) {
 		int mcelsius = temp.mkelvin - 273150;
-		const char *sign ="";
+
+		put_string(b, pre);
 		if (mcelsius < 0) {
-			sign = "-";
+			put_char(b, '-');
 			mcelsius = - mcelsius;
 		}
-		fprintf(f, "%s%s%u.%03u C%s", pre, sign, FRACTION(mcelsius, 1000), post);
+		put_milli(b, mcelsius);
+		put_string(b, " C");
+		put_string(b, post);
 	}
 }
 
-static void show_depth(FILE *f, depth_t depth, const char *pre, const char *post)
+static void show_depth(struct membuffer *b, depth_t depth, const char *pre, const char *post)
 {
-	if (depth.mm)
-		fprintf(f, "%s%u.%03u m%s", pre, FRACTION(depth.mm, 1000), post);
+	if (depth.mm) {
+		put_string(b, pre);
+		put_milli(b, depth.mm);
+		put_string(b, " m");
+		put_string(b, post);
+	}
 }
 
-static void show_duration(FILE *f, duration_t duration, const char *pre, const char *post)
+static void show_duration(struct membuffer *b, duration_t duration, const char *pre, const char *post)
 {
-	if (duration.seconds)
-		fprintf(f, "%s%u:%02u min%s", pre, FRACTION(duration.seconds, 60), post);
+	if (duration.seconds) {
+		put_string(b, pre);
+		put_fraction(b, duration.seconds, 60, ':', 2);
+		put_string(b, " min");
+		put_string(b, post);
+	}
 }
 
-static void show_pressure(FILE *f, pressure_t pressure, const char *pre, const char *post)
+static void show_pressure(struct membuffer *b, pressure_t pressure, const char *pre, const char *post)
 {
-	if (pressure.mbar)
-		fprintf(f, "%s%u.%03u bar%s", pre, FRACTION(pressure.mbar, 1000), post);
+	if (pressure.mbar) {
+		put_string(b, pre);
+		put_milli(b, pressure.mbar);
+		put_string(b, " bar");
+		put_string(b, post);
+	}
 }
 
 /*
@@ -51,7 +78,7 @@ static void show_pressure(FILE *f, pressure_t pressure, const char *pre, const c
  * Nothing else (and if we ever do this using attributes, we'd need to
  * quote the quotes we use too).
  */
-static void quote(FILE *f, const char *text)
+static void quote(struct membuffer *b, const char *text)
 {
 	const char *p = text;
 
@@ -79,15 +106,15 @@ static void quote(FILE *f, const char *text)
 			escape = "&amp;";
 			break;
 		}
-		fwrite(text, (p - text - 1), 1, f);
+		put_bytes(b, text, (p - text - 1));
 		if (!escape)
 			break;
-		fputs(escape, f);
+		put_string(b, escape);
 		text = p;
 	}
 }
 
-static void show_utf8(FILE *f, const char *text, const char *pre, const char *post)
+static void show_utf8(struct membuffer *b, const char *text, const char *pre, const char *post)
 {
 	int len;
 
@@ -101,26 +128,26 @@ static void show_utf8(FILE *f, const char *text, const char *pre, const char *po
 	while (len && isspace(text[len-1]))
 		len--;
 	/* FIXME! Quoting! */
-	fputs(pre, f);
-	quote(f, text);
-	fputs(post, f);
+	put_string(b, pre);
+	quote(b, text);
+	put_string(b, post);
 }
 
-static void save_overview(FILE *f, struct dive *dive)
+static void save_overview(struct membuffer *b, struct dive *dive)
 {
-	show_depth(f, dive->maxdepth, "  <maxdepth>", "</maxdepth>\n");
-	show_depth(f, dive->meandepth, "  <meandepth>", "</meandepth>\n");
-	show_temperature(f, dive->airtemp, "  <airtemp>", "</airtemp>\n");
-	show_temperature(f, dive->watertemp, "  <watertemp>", "</watertemp>\n");
-	show_duration(f, dive->duration, "  <duration>", "</duration>\n");
-	show_duration(f, dive->surfacetime, "  <surfacetime>", "</surfacetime>\n");
-	show_pressure(f, dive->beginning_pressure, "  <cylinderstartpressure>", "</cylinderstartpressure>\n");
-	show_pressure(f, dive->end_pressure, "  <cylinderendpressure>", "</cylinderendpressure>\n");
-	show_utf8(f, dive->location, "  <location>","</location>\n");
-	show_utf8(f, dive->notes, "  <notes>","</notes>\n");
+	show_depth(b, dive->maxdepth, "  <maxdepth>", "</maxdepth>\n");
+	show_depth(b, dive->meandepth, "  <meandepth>", "</meandepth>\n");
+	show_temperature(b, dive->airtemp, "  <airtemp>", "</airtemp>\n");
+	show_temperature(b, dive->watertemp, "  <watertemp>", "</watertemp>\n");
+	show_duration(b, dive->duration, "  <duration>", "</duration>\n");
+	show_duration(b, dive->surfacetime, "  <surfacetime>", "</surfacetime>\n");
+	show_pressure(b, dive->beginning_pressure, "  <cylinderstartpressure>", "</cylinderstartpressure>\n");
+	show_pressure(b, dive->end_pressure, "  <cylinderendpressure>", "</cylinderendpressure>\n");
+	show_utf8(b, dive->location, "  <location>","</location>\n");
+	show_utf8(b, dive->notes, "  <notes>","</notes>\n");
 }
 
-static void save_gasmix(FILE *f, struct dive *dive)
+static void save_gasmix(struct membuffer *b, struct dive *dive)
 {
 	int i;
 
@@ -131,55 +158,687 @@ static void save_gasmix(FILE *f, struct dive *dive)
 
 		if (!mix->o2.permille)
 			return;
-		fprintf(f, "  <gasmix o2='%u.%u%%'", FRACTION(o2, 10));
-		if (mix->he.permille)
-			fprintf(f, " he='%u.%u%%'", FRACTION(he, 10));
-		fprintf(f, " n2='%u.%u%%' />\n", FRACTION(n2, 10));
+		put_string(b, "  <gasmix o2='");
+		put_fraction(b, o2, 10, '.', 1);
+		put_string(b, "%'");
+		if (mix->he.permille) {
+			put_string(b, " he='");
+			put_fraction(b, he, 10, '.', 1);
+			put_string(b, "%'");
+		}
+		put_string(b, " n2='");
+		put_fraction(b, n2, 10, '.', 1);
+		put_string(b, "%' />\n");
+	}
+}
+
+/* Up to the last cylinder we know anything about, by tank index */
+static void save_cylinders(struct membuffer *b, struct dive *dive)
+{
+	int i, nr = MAX_MIXES;
+
+	while (nr && !dive->tank_type[nr-1].size.mliter && !dive->tank_type[nr-1].pressure.mbar)
+		nr--;
+	for (i = 0; i < nr; i++) {
+		tank_type_t *tank = dive->tank_type+i;
+
+		put_string(b, "  <cylinder");
+		if (tank->size.mliter) {
+			put_string(b, " size='");
+			put_milli(b, tank->size.mliter);
+			put_string(b, " l'");
+		}
+		show_pressure(b, tank->pressure, " workpressure='", "'");
+		put_string(b, " />\n");
 	}
 }
 
-static void save_sample(FILE *f, struct sample *sample)
+static void save_sample(struct membuffer *b, struct sample *sample)
 {
-	fprintf(f, "  <sample time='%u:%02u min' depth='%u.%03u m'",
-		FRACTION(sample->time.seconds,60),
-		FRACTION(sample->depth.mm, 1000));
-	show_temperature(f, sample->temperature, " temp='", "'");
-	show_pressure(f, sample->tankpressure, " pressure='", "'");
+	put_string(b, "  <sample time='");
+	put_fraction(b, sample->time.seconds, 60, ':', 2);
+	put_string(b, " min' depth='");
+	put_milli(b, sample->depth.mm);
+	put_string(b, " m'");
+	show_temperature(b, sample->temperature, " temp='", "'");
+	show_pressure(b, sample->tankpressure, " pressure='", "'");
 	if (sample->tankindex)
-		fprintf(f, " tankindex='%d'", sample->tankindex);
-	fprintf(f, " />\n");
+		put_format(b, " tankindex='%d'", sample->tankindex);
+	put_string(b, " />\n");
 }
 
-static void save_dive(FILE *f, struct dive *dive)
+static void save_dive(struct membuffer *b, struct dive *dive)
 {
 	int i;
-	struct tm *tm = gmtime(&dive->when);
+	struct tm tm;
 
-	fprintf(f, "<dive date='%04u-%02u-%02u' time='%02u:%02u:%02u'>\n",
-		tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-		tm->tm_hour, tm->tm_min, tm->tm_sec);
-	save_overview(f, dive);
-	save_gasmix(f, dive);
+	gmtime_r(&dive->when, &tm);
+	put_format(b, "<dive date='%04u-%02u-%02u' time='%02u:%02u:%02u'>\n",
+		tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+	save_overview(b, dive);
+	save_gasmix(b, dive);
+	save_cylinders(b, dive);
+	load_samples(dive);
 	for (i = 0; i < dive->samples; i++)
-		save_sample(f, dive->sample+i);
-	fprintf(f, "</dive>\n");
+		save_sample(b, dive->sample+i);
+	put_string(b, "</dive>\n");
 }
 
 #define VERSION 1
 
-void save_dives(const char *filename)
+/* Write out in big chunks, not for every little dive */
+#define FLUSH_SIZE (256*1024)
+
+/*
+ * Where the XML goes: straight into the file, or through deflate
+ * for a ".gz" file. Either way we stream it out a buffer at a
+ * time, so the whole document never has to be in memory.
+ *
+ * Level 3 gets our XML down to about 13% of its size, against 11%
+ * for the default level 6, in less than half the time.
+ */
+#define GZIP_LEVEL 3
+
+struct output {
+	int fd;
+	int gzip;
+	z_stream z;
+	struct membuffer out;
+};
+
+static int deflate_buffer(struct membuffer *b, struct output *o, int flush)
+{
+	z_stream *z = &o->z;
+
+	z->next_in = (Bytef *) b->buffer;
+	z->avail_in = b->len;
+	make_room(&o->out, FLUSH_SIZE);
+	do {
+		z->next_out = (Bytef *) o->out.buffer;
+		z->avail_out = o->out.alloc;
+		if (deflate(z, flush) == Z_STREAM_ERROR) {
+			errno = EIO;
+			return -1;
+		}
+		o->out.len = o->out.alloc - z->avail_out;
+		if (write_buffer(&o->out, o->fd) < 0)
+			return -1;
+	} while (!z->avail_out);
+	b->len = 0;
+	return 0;
+}
+
+/* No file at all means we're only formatting: it all stays in the buffer */
+static int flush_output(struct membuffer *b, struct output *o)
+{
+	if (o->fd < 0)
+		return 0;
+	if (o->gzip)
+		return deflate_buffer(b, o, Z_NO_FLUSH);
+	return write_buffer(b, o->fd);
+}
+
+static int start_output(struct output *o, int fd, const char *filename)
+{
+	int len = strlen(filename);
+
+	memset(o, 0, sizeof(*o));
+	o->fd = fd;
+	o->gzip = len > 3 && !strcmp(filename + len - 3, ".gz");
+	if (!o->gzip)
+		return 0;
+
+	/* 16 more window bits means "write a gzip header" */
+	if (deflateInit2(&o->z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static int finish_output(struct membuffer *b, struct output *o)
+{
+	if (o->fd < 0)
+		return 0;
+	if (o->gzip)
+		return deflate_buffer(b, o, Z_FINISH);
+	return write_buffer(b, o->fd);
+}
+
+static void end_output(struct output *o)
+{
+	if (o->gzip)
+		deflateEnd(&o->z);
+	free_buffer(&o->out);
+}
+
+static int save_dives_serial(struct membuffer *b, struct output *o)
 {
 	int i;
-	FILE *f = fopen(filename, "w");
 
-	if (!f)
-		return;
+	for (i = 0; i < dive_table.nr; i++) {
+		save_dive(b, get_dive(i));
+		if (b->len >= FLUSH_SIZE && flush_output(b, o) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Parallel saving.
+ *
+ * Every dive is saved independently of the others, so we can have
+ * a number of worker threads each format one dive at a time into
+ * its own buffer, and have the main thread write those out in
+ * table order. The result is exactly what the serial save gives.
+ *
+ * The workers can only get SAVE_WINDOW dives ahead of the writer,
+ * so we don't end up with the whole file in memory if the disk is
+ * slower than the formatting.
+ */
+#define SAVE_WINDOW 64
+
+/* Not worth starting threads for a handful of dives */
+#define PARALLEL_MIN_DIVES 32
+
+int save_threads;
+
+static struct save_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next, written, nr;
+	int error;
+	struct membuffer buffer[SAVE_WINDOW];
+	char done[SAVE_WINDOW];
+} save_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *save_worker(void *unused)
+{
+	struct save_state *s = &save_state;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		int i;
+
+		while (!s->error && s->next < s->nr && s->next - s->written >= SAVE_WINDOW)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->error || s->next >= s->nr)
+			break;
+		i = s->next++;
+
+		pthread_mutex_unlock(&s->lock);
+		save_dive(s->buffer + i % SAVE_WINDOW, get_dive(i));
+		pthread_mutex_lock(&s->lock);
+
+		s->done[i % SAVE_WINDOW] = 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int save_dives_parallel(struct membuffer *b, struct output *o, int threads)
+{
+	struct save_state *s = &save_state;
+	pthread_t thread[threads];
+	int i, started, err = 0;
+
+	s->next = 0;
+	s->written = 0;
+	s->nr = dive_table.nr;
+	s->error = 0;
+	memset(s->done, 0, sizeof(s->done));
+
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(thread + started, NULL, save_worker, NULL))
+			break;
+	}
+	if (!started)
+		return save_dives_serial(b, o);
+
+	for (i = 0; i < s->nr; i++) {
+		struct membuffer *dive = s->buffer + i % SAVE_WINDOW;
+
+		pthread_mutex_lock(&s->lock);
+		while (!s->done[i % SAVE_WINDOW])
+			pthread_cond_wait(&s->cond, &s->lock);
+		pthread_mutex_unlock(&s->lock);
+
+		put_bytes(b, dive->buffer, dive->len);
+		dive->len = 0;
+		if (b->len >= FLUSH_SIZE && flush_output(b, o) < 0) {
+			err = errno;
+			break;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->done[i % SAVE_WINDOW] = 0;
+		s->written = i + 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	/* On a write error, tell the workers to stop */
+	pthread_mutex_lock(&s->lock);
+	s->error = err;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	while (started)
+		pthread_join(thread[--started], NULL);
+	for (i = 0; i < SAVE_WINDOW; i++)
+		free_buffer(s->buffer + i);
+
+	errno = err;
+	return err ? -1 : 0;
+}
+
+/* How many threads to format the dives with? */
+static int nr_save_threads(void)
+{
+	int threads = save_threads;
+
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 2 || dive_table.nr < PARALLEL_MIN_DIVES)
+		return 1;
+	return threads;
+}
+
+static int output_xml(struct membuffer *buf, struct output *o)
+{
+	int threads, ret;
+
+	put_format(buf, "<dives>\n<program name='diveclog' version='%d'></program>\n", VERSION);
+	threads = nr_save_threads();
+	if (threads > 1)
+		ret = save_dives_parallel(buf, o, threads);
+	else
+		ret = save_dives_serial(buf, o);
+	if (ret < 0)
+		return -1;
+	put_string(buf, "</dives>\n");
+	return finish_output(buf, o);
+}
+
+/*
+ * Write out the dive table to 'filename', in the format that the
+ * name 'format' asks for. That's normally the same name, but a
+ * temporary file that gets renamed over a log file has to come out
+ * like the log file.
+ *
+ * This doesn't ask the GUI for pending edits first, so it can run
+ * outside the main thread (with the dive table locked).
+ *
+ * Returns 0 on success. On failure, returns -1 with errno set,
+ * and we've already complained about it.
+ */
+int write_dives_as(const char *filename, const char *format)
+{
+	int fd, err = 0;
+	struct membuffer buf = { 0 };
+	struct output o;
+	struct stat st;
+	int len = strlen(format);
+
+	/* "dir/" or an existing directory means a dive directory */
+	if ((len && format[len-1] == '/') || (!stat(format, &st) && S_ISDIR(st.st_mode)))
+		return save_dive_directory(filename);
+
+	if (len > 4 && !strcmp(format + len - 4, ".dlb"))
+		return save_binary_file(filename);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		goto fail;
+	if (start_output(&o, fd, format) < 0)
+		goto close_fail;
+
+	/* The journal gets dropped after this, so it had better be on disk */
+	if (output_xml(&buf, &o) < 0 || fsync(fd) < 0)
+		goto close_fail;
+	end_output(&o);
+	free_buffer(&buf);
+
+	/* close() is where NFS tells us about write errors */
+	if (close(fd) < 0)
+		goto fail;
+	return 0;
+
+close_fail:
+	err = errno;
+	end_output(&o);
+	close(fd);
+	errno = err;
+fail:
+	err = errno;
+	free_buffer(&buf);
+	fprintf(stderr, "Failed to save '%s': %s\n", filename, strerror(err));
+	errno = err;
+	return -1;
+}
+
+int format_dives(const char *format, struct membuffer *b)
+{
+	struct output o;
+	int len = strlen(format);
+
+	if (len > 4 && !strcmp(format + len - 4, ".dlb")) {
+		format_binary(b);
+		return 0;
+	}
+	memset(&o, 0, sizeof(o));
+	o.fd = -1;
+	return output_xml(b, &o);
+}
+
+/*
+ * ..and write out what format_dives() gave us. This is where a
+ * gzipped log gets compressed, so that doesn't need the lock either.
+ */
+int write_formatted_dives(const char *filename, const char *format, struct membuffer *b)
+{
+	int fd, err;
+	struct output o;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		goto fail;
+	if (start_output(&o, fd, format) < 0)
+		goto close_fail;
+	if (finish_output(b, &o) < 0 || fsync(fd) < 0)
+		goto close_fail;
+	end_output(&o);
+	if (close(fd) < 0)
+		goto fail;
+	return 0;
+
+close_fail:
+	err = errno;
+	end_output(&o);
+	close(fd);
+	errno = err;
+fail:
+	err = errno;
+	fprintf(stderr, "Failed to save '%s': %s\n", filename, strerror(err));
+	errno = err;
+	return -1;
+}
+
+int write_dives(const char *filename)
+{
+	return write_dives_as(filename, filename);
+}
+
+int save_dives(const char *filename)
+{
+	int ret;
 
 	/* Flush any edits of current dives back to the dives! */
 	flush_dive_info_changes();
 
-	fprintf(f, "<dives>\n<program name='diveclog' version='%d'></program>\n", VERSION);
+	lock_dive_table();
+	ret = write_dives(filename);
+	unlock_dive_table();
+	if (!ret)
+		journal_saved(filename);
+	return ret;
+}
+
+/*
+ * Dive directories.
+ *
+ * Every dive goes into its own little xml file, named by the dive
+ * time, and the "index" file lists them in order. When saving back
+ * to the same directory, only dives that are dirty (or don't have a
+ * file yet) get written, so a save after editing one dive costs one
+ * dive. Every file is written to a temporary name and renamed into
+ * place, and the index goes last, so a crash in the middle leaves
+ * the old index pointing at complete files.
+ */
+#define INDEX_FILE "index"
+#define INDEX_HEADER "diveclog-index 1\n"
+#define DIVE_NAME_LEN 21
+
+const char *dive_directory;
+
+void set_dive_directory(const char *dirname)
+{
+	char *old = (char *)dive_directory;
+
+	dive_directory = strdup(dirname);
+	free(old);
+}
+
+static int same_directory(const char *a, const char *b)
+{
+	struct stat st_a, st_b;
+
+	if (!a || !b)
+		return 0;
+	if (stat(a, &st_a) || stat(b, &st_b))
+		return 0;
+	return st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+/* "2011-03-20-102238.xml": sorts the same way the dives do */
+static void dive_file_name(struct dive *dive, char *name)
+{
+	struct tm tm;
+
+	gmtime_r(&dive->when, &tm);
+	snprintf(name, DIVE_NAME_LEN + 1, "%04u-%02u-%02u-%02u%02u%02u.xml",
+		tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+static int write_file(const char *dirname, const char *name, struct membuffer *b)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/%s", dirname, name);
+	snprintf(tmp, sizeof(tmp), "%s/.%s.tmp", dirname, name);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+	if (write_buffer(b, fd) < 0 || fsync(fd) < 0) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int save_dive_file(const char *dirname, const char *name, struct dive *dive)
+{
+	struct membuffer b = { 0 };
+	int ret;
+
+	put_format(&b, "<dives>\n<program name='diveclog' version='%d'></program>\n", VERSION);
+	save_dive(&b, dive);
+	put_string(&b, "</dives>\n");
+	ret = write_file(dirname, name, &b);
+	free_buffer(&b);
+	return ret;
+}
+
+/*
+ * Read the old index. We get back the file names, one per line,
+ * and point 'names' past the header.
+ */
+static char *read_index(const char *dirname, const char **names)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	char *buf;
+	int fd, len;
+
+	*names = "";
+	snprintf(path, sizeof(path), "%s/" INDEX_FILE, dirname);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return NULL;
+	}
+	len = read(fd, buf, st.st_size);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	buf[len] = 0;
+	if (!strncmp(buf, INDEX_HEADER, strlen(INDEX_HEADER)))
+		*names = buf + strlen(INDEX_HEADER);
+	return buf;
+}
+
+/* Load all the dives listed in the index of a dive directory */
+void parse_dive_directory(const char *dirname)
+{
+	char path[PATH_MAX];
+	const char *names;
+	char *index = read_index(dirname, &names);
+
+	if (!index) {
+		fprintf(stderr, "No dive index in '%s'\n", dirname);
+		return;
+	}
+	while (*names) {
+		const char *end = strchrnul(names, '\n');
+		int len = end - names;
+
+		if (len) {
+			snprintf(path, sizeof(path), "%s/%.*s", dirname, len, names);
+			parse_xml_file(path);
+		}
+		names = *end ? end + 1 : end;
+	}
+	free(index);
+	set_dive_directory(dirname);
+}
+
+/* Compare an index line with a name, like strcmp() */
+static int compare_name(const char *line, int len, const char *name)
+{
+	int cmp = strncmp(line, name, len);
+
+	if (!cmp && name[len])
+		cmp = -1;
+	return cmp;
+}
+
+/*
+ * Is 'name' in the index list at '*list'? Both the index and the
+ * dive table are in time order, so as we go through the dives we
+ * just walk the list along with them, and never go back.
+ */
+static int in_index(const char **list, const char *name)
+{
+	while (**list) {
+		const char *line = *list;
+		const char *end = strchrnul(line, '\n');
+		int cmp = compare_name(line, end - line, name);
+
+		if (cmp > 0)
+			return 0;
+		*list = *end ? end + 1 : end;
+		if (!cmp)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Remove the files of dives that were in the old index, but not in
+ * the new one (ie the current dive table). Only ever remove things
+ * that look like our own dive file names.
+ */
+static void remove_stale_files(const char *dirname, const char *old)
+{
+	char name[DIVE_NAME_LEN + 1], path[PATH_MAX];
+	int i = 0;
+
+	while (*old) {
+		const char *end = strchrnul(old, '\n');
+		int len = end - old, cmp = 1;
+
+		if (len == DIVE_NAME_LEN && !memchr(old, '/', len)) {
+			for (; i < dive_table.nr; i++) {
+				dive_file_name(get_dive(i), name);
+				cmp = compare_name(old, len, name);
+				if (cmp <= 0)
+					break;
+			}
+			if (cmp) {
+				snprintf(path, sizeof(path), "%s/%.*s", dirname, len, old);
+				unlink(path);
+			}
+		}
+		old = *end ? end + 1 : end;
+	}
+}
+
+int save_dive_directory(const char *dirname)
+{
+	struct membuffer index = { 0 };
+	const char *old, *list;
+	char *old_index;
+	int i, same, written = 0;
+
+	if (mkdir(dirname, 0777) < 0 && errno != EEXIST)
+		goto fail;
+
+	same = same_directory(dirname, dive_directory);
+	old_index = read_index(dirname, &old);
+	list = old;
+
+	put_string(&index, INDEX_HEADER);
+	for (i = 0; i < dive_table.nr; i++) {
+		struct dive *dive = get_dive(i);
+		char name[DIVE_NAME_LEN + 1];
+
+		dive_file_name(dive, name);
+		put_string(&index, name);
+		put_char(&index, '\n');
+
+		if (in_index(&list, name) && same && !dive->dirty)
+			continue;
+		if (save_dive_file(dirname, name, dive) < 0)
+			goto fail_index;
+		written++;
+	}
+	if (write_file(dirname, INDEX_FILE, &index) < 0)
+		goto fail_index;
+	free_buffer(&index);
+
+	/* Only now that the new index is in place can the old dives go */
+	remove_stale_files(dirname, old);
+	free(old_index);
+
 	for (i = 0; i < dive_table.nr; i++)
-		save_dive(f, get_dive(i));
-	fprintf(f, "</dives>\n");
+		get_dive(i)->dirty = 0;
+	set_dive_directory(dirname);
+	if (verbose)
+		printf("Saved %d of %d dives to '%s'\n", written, dive_table.nr, dirname);
+	return 0;
+
+fail_index:
+	free(old_index);
+	free_buffer(&index);
+fail:
+	fprintf(stderr, "Failed to save '%s': %s\n", dirname, strerror(errno));
+	return -1;
 }
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "dive.h"
+
+/*
+ * How fast the log formats save and load, and how big they get.
+ * "make bench" runs this on all of dives/.
+ *
+ * The parent never loads anything. A child loads the log files it's
+ * given like divelog does at startup, and saves the dives as XML,
+ * gzipped XML and binary. Then every load of those gets a child of its
+ * own, starting from an empty dive table, and does the whole parse,
+ * sort and merge. We take the best of a few runs of everything. A
+ * binary log doesn't unpack the samples until somebody looks at them,
+ * so for that we also time loading it with all the samples unpacked.
+ *
+ * No GUI here, so nobody has any pending edits.
+ */
+#define RUNS 5
+
+void flush_dive_info_changes(void)
+{
+}
+
+static const char *formats[] = { "xml", "xml.gz", "dlb" };
+#define NR_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *bench_file(int format)
+{
+	static char name[64];
+
+	snprintf(name, sizeof(name), "savebench.%s", formats[format]);
+	return name;
+}
+
+/* Run 'fn' in a child, with nothing loaded, and get back its 'nr' results */
+static void in_child(void (*fn)(void *, double *), void *arg, double *res, int nr)
+{
+	int fd[2], status, len = nr * sizeof(*res);
+	pid_t pid;
+
+	if (pipe(fd) < 0)
+		exit(1);
+	pid = fork();
+	if (pid < 0)
+		exit(1);
+	if (!pid) {
+		close(fd[0]);
+		fn(arg, res);
+		if (write(fd[1], res, len) != len)
+			_exit(1);
+		_exit(0);
+	}
+	close(fd[1]);
+	if (read(fd[0], res, len) != len)
+		exit(1);
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+}
+
+/* Like divelog starting up with these files */
+static void load(char **files, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		parse_xml_file(files[i]);
+	sort_dive_table();
+	merge_dive_table();
+}
+
+/* res[0] is the number of dives, then the best save time of every format */
+static void save_all(void *arg, double *res)
+{
+	char **files = arg;
+	int i, j, nr;
+
+	for (nr = 0; files[nr]; nr++)
+		;
+	load(files, nr);
+	res[0] = dive_table.nr;
+	for (i = 0; i < NR_FORMATS; i++) {
+		for (j = 0; j < RUNS; j++) {
+			double start = now(), t;
+
+			if (write_dives(bench_file(i)) < 0)
+				_exit(1);
+			t = now() - start;
+			if (!j || t < res[i + 1])
+				res[i + 1] = t;
+		}
+	}
+}
+
+struct load_run {
+	const char *name;
+	int unpack;
+};
+
+static void load_one(void *arg, double *res)
+{
+	struct load_run *run = arg;
+	double start = now();
+	char *files[] = { (char *) run->name };
+	int i;
+
+	load(files, 1);
+	if (run->unpack) {
+		for (i = 0; i < dive_table.nr; i++)
+			load_samples(dive_table.dives[i]);
+	}
+	res[0] = now() - start;
+}
+
+static double time_load(const char *name, int unpack)
+{
+	struct load_run run = { name, unpack };
+	double best = 0, t;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		in_child(load_one, &run, &t, 1);
+		if (!i || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	double saved[NR_FORMATS + 1];
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: savebench <log file>...\n");
+		exit(1);
+	}
+	parse_xml_init();
+	in_child(save_all, argv + 1, saved, NR_FORMATS + 1);
+
+	printf("%d dives\n", (int) saved[0]);
+	printf("%-8s %10s %10s %10s\n", "format", "bytes", "save ms", "load ms");
+	for (i = 0; i < NR_FORMATS; i++) {
+		const char *name = bench_file(i);
+		struct stat st;
+
+		if (stat(name, &st) < 0)
+			exit(1);
+		printf("%-8s %10lld %10.2f %10.2f", formats[i], (long long) st.st_size,
+			saved[i + 1] * 1000, time_load(name, 0) * 1000);
+		if (!strcmp(formats[i], "dlb"))
+			printf(" (%.2f with samples)", time_load(name, 1) * 1000);
+		printf("\n");
+		unlink(name);
+	}
+	return 0;
+}
@@ -0,0 +1,231 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "dive.h"
+
+/*
+ * Full-text index over the dive location and notes.
+ *
+ * Every word (run of letters and digits, lower-cased, and any
+ * non-ascii utf8 bytes are considered letters) maps to the list
+ * of dives that have it. The words are kept in a sorted array, so
+ * a prefix query is a binary search for the first word with that
+ * prefix, and then a walk over the words that share it.
+ *
+ * Like the other indexes, we point to the dives themselves, and
+ * only turn them into table indexes when answering a query.
+ */
+struct word {
+	int nr, allocated;
+	struct dive **dives;
+	char name[];
+};
+
+static struct word_table {
+	int nr, allocated;
+	struct word **words;
+} word_table;
+
+#define MAXWORD 64
+
+/* Lower-case the next word into 'buf', return the text after it */
+static const char *next_word(const char *text, char *buf, int *len)
+{
+	int n = 0;
+	unsigned char c;
+
+	for (;;) {
+		c = *text;
+		if (!c) {
+			*len = 0;
+			return text;
+		}
+		if (isalnum(c) || c >= 0x80)
+			break;
+		text++;
+	}
+
+	while ((c = *text) != 0 && (isalnum(c) || c >= 0x80)) {
+		if (n < MAXWORD)
+			buf[n++] = tolower(c);
+		text++;
+	}
+	buf[n] = 0;
+	*len = n;
+	return text;
+}
+
+/* First word not sorting before 'name' */
+static int lookup_word(const char *name)
+{
+	struct word **words = word_table.words;
+	int lo = 0, hi = word_table.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (strcmp(words[mid]->name, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct word *find_word(const char *name, int len, int create)
+{
+	int pos = lookup_word(name);
+	int nr = word_table.nr;
+	struct word *word;
+
+	if (pos < nr && !strcmp(word_table.words[pos]->name, name))
+		return word_table.words[pos];
+	if (!create)
+		return NULL;
+
+	if (nr >= word_table.allocated) {
+		int allocated = (nr + 64) * 3 / 2;
+		struct word **words = realloc(word_table.words, allocated * sizeof(*words));
+		if (!words)
+			exit(1);
+		word_table.words = words;
+		word_table.allocated = allocated;
+	}
+	word = malloc(sizeof(*word) + len + 1);
+	if (!word)
+		exit(1);
+	memset(word, 0, sizeof(*word));
+	memcpy(word->name, name, len + 1);
+
+	memmove(word_table.words + pos + 1, word_table.words + pos, (nr - pos) * sizeof(struct word *));
+	word_table.words[pos] = word;
+	word_table.nr = nr + 1;
+	return word;
+}
+
+static void add_text(struct dive *dive, const char *text)
+{
+	char buf[MAXWORD+1];
+	int len;
+
+	if (!text)
+		return;
+	for (;;) {
+		struct word *word;
+		int nr;
+
+		text = next_word(text, buf, &len);
+		if (!len)
+			break;
+		word = find_word(buf, len, 1);
+
+		/*
+		 * We add all the words of a dive in one go, so if
+		 * the dive already has this word, it's the last one.
+		 */
+		nr = word->nr;
+		if (nr && word->dives[nr-1] == dive)
+			continue;
+		if (nr >= word->allocated) {
+			int allocated = (nr + 4) * 3 / 2;
+			struct dive **dives = realloc(word->dives, allocated * sizeof(*dives));
+			if (!dives)
+				exit(1);
+			word->dives = dives;
+			word->allocated = allocated;
+		}
+		word->dives[nr] = dive;
+		word->nr = nr + 1;
+	}
+}
+
+static void remove_text(struct dive *dive, const char *text)
+{
+	char buf[MAXWORD+1];
+	int len, i;
+
+	if (!text)
+		return;
+	for (;;) {
+		struct word *word;
+
+		text = next_word(text, buf, &len);
+		if (!len)
+			break;
+		word = find_word(buf, len, 0);
+		if (!word)
+			continue;
+		for (i = 0; i < word->nr; i++) {
+			if (word->dives[i] != dive)
+				continue;
+			word->dives[i] = word->dives[--word->nr];
+			break;
+		}
+	}
+}
+
+void index_dive_text(struct dive *dive)
+{
+	add_text(dive, dive->location);
+	add_text(dive, dive->notes);
+}
+
+void unindex_dive_text(struct dive *dive)
+{
+	remove_text(dive, dive->location);
+	remove_text(dive, dive->notes);
+}
+
+/*
+ * Mark the dives that have a word starting with 'prefix' by
+ * bumping their count from 'stamp-1' to 'stamp'. That way several
+ * words in one query become an "and" without clearing anything
+ * in between.
+ */
+static void mark_prefix(const char *prefix, int len, unsigned char *count, unsigned char stamp)
+{
+	int pos = lookup_word(prefix);
+
+	for (; pos < word_table.nr; pos++) {
+		struct word *word = word_table.words[pos];
+		int i;
+
+		if (strncmp(word->name, prefix, len))
+			break;
+		for (i = 0; i < word->nr; i++) {
+			int idx = dive_table_index(word->dives[i]);
+			if (idx >= 0 && count[idx] == stamp - 1)
+				count[idx] = stamp;
+		}
+	}
+}
+
+/*
+ * Find the dives that have words starting with each of the words
+ * in the query, so "lin bud" finds dives with "Linus" and "buddy".
+ * 'match' gets one byte per dive in table order, like run_filter().
+ * Returns the number of matching dives.
+ */
+int search_dives(const char *query, unsigned char *match)
+{
+	char buf[MAXWORD+1];
+	unsigned char stamp = 0;
+	int i, len, nr = dive_table.nr, count = 0;
+
+	memset(match, 0, nr);
+	for (;;) {
+		query = next_word(query, buf, &len);
+		if (!len)
+			break;
+		/* More than 255 words? You're not searching, you're typing a novel */
+		if (stamp == 255)
+			break;
+		mark_prefix(buf, len, match, ++stamp);
+	}
+
+	for (i = 0; i < nr; i++) {
+		match[i] = stamp && match[i] == stamp;
+		count += match[i];
+	}
+	return count;
+}
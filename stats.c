@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dive.h"
+#include "display.h"
+
+/*
+ * Statistics: the gas consumption per year, over all the dives of
+ * that year that have the tank pressures and cylinder sizes for it.
+ * The first look at it works it out for the whole log, see sac.c,
+ * after that it's just the few years that changed. We only refill
+ * the list when the dive table changed since the last time.
+ */
+static GtkListStore *stats_store;
+static unsigned int stats_generation = -1;
+
+enum { YEAR_COLUMN, DIVES_COLUMN, SAC_COLUMN };
+
+static void fill_stats(void)
+{
+	const struct sac_year *year;
+	GtkTreeIter iter;
+	int i, nr;
+
+	gtk_list_store_clear(stats_store);
+	lock_dive_table();
+	stats_generation = dive_table.generation;
+	year = sac_years(&nr);
+	for (i = 0; i < nr; i++) {
+		char sac[32];
+
+		snprintf(sac, sizeof(sac), "%.1f l/min",
+			sac_rate(year[i].gas, year[i].exposure) / 1000.0);
+		gtk_list_store_append(stats_store, &iter);
+		gtk_list_store_set(stats_store, &iter,
+			YEAR_COLUMN, year[i].year,
+			DIVES_COLUMN, year[i].dives,
+			SAC_COLUMN, sac,
+			-1);
+	}
+	unlock_dive_table();
+}
+
+static gboolean stats_expose_event(GtkWidget *widget, GdkEventExpose *event, gpointer data)
+{
+	if (stats_generation != dive_table.generation)
+		fill_stats();
+	return FALSE;
+}
+
+static void stats_column(GtkWidget *tree_view, const char *title, int column)
+{
+	GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+	GtkTreeViewColumn *col;
+
+	col = gtk_tree_view_column_new_with_attributes(title, renderer, "text", column, NULL);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(tree_view), col);
+}
+
+GtkWidget *dive_stats_frame(void)
+{
+	GtkWidget *frame, *tree_view, *scroll_window;
+
+	frame = gtk_frame_new("Gas consumption per year");
+	gtk_widget_show(frame);
+
+	stats_store = gtk_list_store_new(3, G_TYPE_INT, G_TYPE_INT, G_TYPE_STRING);
+	tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(stats_store));
+	g_signal_connect(tree_view, "expose_event", G_CALLBACK(stats_expose_event), NULL);
+
+	stats_column(tree_view, "Year", YEAR_COLUMN);
+	stats_column(tree_view, "Dives", DIVES_COLUMN);
+	stats_column(tree_view, "SAC", SAC_COLUMN);
+
+	scroll_window = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll_window),
+		GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scroll_window), tree_view);
+	gtk_container_add(GTK_CONTAINER(frame), scroll_window);
+	return frame;
+}